@@ -5,4 +5,6 @@ clang-format-4.0 \
     -i \
     sllq.c \
     sllq.h \
-    sllqbench/sllqbench.c
+    sllq.hpp \
+    sllqbench/sllqbench.c \
+    sllqbench/sllqhpp.cc
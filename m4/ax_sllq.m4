@@ -19,5 +19,21 @@
 
 AC_DEFUN([AX_SLLQ], [
     AC_CHECK_SIZEOF(void*)
+    AC_ARG_ENABLE([sllq-stats],
+        [AS_HELP_STRING([--enable-sllq-stats], [keep sllq queue statistics])],
+        [], [enable_sllq_stats=no])
+    AS_IF([test "x$enable_sllq_stats" = "xyes"],
+        [AC_DEFINE([SLLQ_STATS], [1], [Define to 1 to keep sllq queue statistics])])
     AX_PTHREAD
+    AC_SEARCH_LIBS([clock_gettime], [rt])
+    AC_SEARCH_LIBS([shm_open], [rt])
+    AC_CHECK_HEADERS([linux/futex.h linux/mempolicy.h sys/eventfd.h])
+    AC_CHECK_FUNCS([ppoll memfd_create shm_open])
+    save_LIBS="$LIBS"
+    save_CFLAGS="$CFLAGS"
+    LIBS="$PTHREAD_LIBS $LIBS"
+    CFLAGS="$CFLAGS $PTHREAD_CFLAGS"
+    AC_CHECK_FUNCS([pthread_condattr_setclock])
+    LIBS="$save_LIBS"
+    CFLAGS="$save_CFLAGS"
 ])
@@ -22,6 +22,11 @@
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
+#if (HAVE_PPOLL || HAVE_MEMFD_CREATE) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+/* The out-of-line versions of the inline calls are defined here */
+#undef SLLQ_INLINE
 #include "sllq.h"
 
 #include <stdlib.h>
@@ -30,637 +35,4422 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#if HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#endif
+#if HAVE_LINUX_MEMPOLICY_H
+#include <linux/mempolicy.h>
+#endif
+#if HAVE_LINUX_FUTEX_H || HAVE_LINUX_MEMPOLICY_H
+#include <sys/syscall.h>
+#endif
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 /*
- * Version
+ * Atomics
  */
 
-static const char* _version = SLLQ_VERSION_STR;
-inline const char* sllq_version_str(void)
+#define _sllq_load(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define _sllq_load_acquire(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define _sllq_store(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#define _sllq_store_release(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define _sllq_cas(ptr, expected, desired) __atomic_compare_exchange_n((ptr), (expected), (desired), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define _sllq_cas_seq_cst(ptr, expected, desired) __atomic_compare_exchange_n((ptr), (expected), (desired), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+#define _sllq_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * Statistics, all compiled out without SLLQ_STATS
+ */
+
+static inline void _sllq_stat_add(const sllq_t* queue, size_t* counter, size_t n)
 {
-    return _version;
+    /* A single producer and consumer can update without a locked add */
+    if (queue->mode == SLLQ_ATOMIC || queue->mode == SLLQ_EVENTFD || queue->mode == SLLQ_SHM) {
+        _sllq_store(counter, _sllq_load(counter) + n);
+    } else {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    }
 }
 
-inline int sllq_version_major(void)
+#if SLLQ_STATS
+#define _sllq_stat_wakeup(wait) __atomic_fetch_add(&((wait)->wakeups), 1, __ATOMIC_RELAXED)
+
+static inline void _sllq_stat_high_water(sllq_t* queue, size_t depth)
 {
-    return SLLQ_VERSION_MAJOR;
+    size_t high_water = _sllq_load(&(queue->push_stats.high_water));
+
+    while (depth > high_water && !_sllq_cas(&(queue->push_stats.high_water), &high_water, depth))
+        ;
 }
+#else
+#define _sllq_stat_wakeup(wait)
+#endif
 
-inline int sllq_version_minor(void)
+static size_t _sllq_depth(const sllq_t* queue);
+
+static inline int _sllq_count(sllq_t* queue, sllq_counters_t* counters, int err, size_t n)
 {
-    return SLLQ_VERSION_MINOR;
+#if SLLQ_STATS
+    switch (err) {
+    case SLLQ_OK:
+        _sllq_stat_add(queue, &(counters->ops), n);
+        /* Sample the depth every 64 pushes for the high-water mark */
+        if (counters == &(queue->push_stats) && (_sllq_load(&(counters->ops)) & 63) < n) {
+            _sllq_stat_high_water(queue, _sllq_depth(queue));
+        }
+        break;
+    case SLLQ_EAGAIN:
+        _sllq_stat_add(queue, &(counters->again), 1);
+        break;
+    case SLLQ_FULL:
+        _sllq_stat_high_water(queue, queue->size);
+        /* fall through */
+    case SLLQ_EMPTY:
+        _sllq_stat_add(queue, &(counters->full), 1);
+        break;
+    case SLLQ_ETIMEDOUT:
+        _sllq_stat_add(queue, &(counters->timeouts), 1);
+        break;
+    }
+#else
+    (void)queue;
+    (void)counters;
+    (void)n;
+#endif
+
+    return err;
 }
 
-inline int sllq_version_patch(void)
+static inline void _sllq_count_wait(sllq_t* queue, sllq_counters_t* counters)
 {
-    return SLLQ_VERSION_PATCH;
+#if SLLQ_STATS
+    _sllq_stat_add(queue, &(counters->waits), 1);
+#else
+    (void)queue;
+    (void)counters;
+#endif
 }
 
 /*
- * New/Free
+ * Latency, ticks are the TSC or the ARM virtual counter where there is
+ * one and nanoseconds otherwise. The histogram has _SLLQ_LATENCY_SUB
+ * linear buckets for each power of two which keeps the error within 3%.
  */
 
-static sllq_t _sllq_t_defaults = SLLQ_T_INIT;
+#define _SLLQ_LATENCY_BITS 5
+#define _SLLQ_LATENCY_SUB (1 << _SLLQ_LATENCY_BITS)
+#define _SLLQ_LATENCY_BUCKETS ((64 - _SLLQ_LATENCY_BITS + 1) * _SLLQ_LATENCY_SUB)
 
-sllq_t* sllq_new(void)
+#if defined(__i386__) || defined(__x86_64__) || defined(__aarch64__)
+#define _SLLQ_LATENCY_TICKS 1
+#endif
+
+static inline uint64_t _sllq_ticks(void)
 {
-    sllq_t* queue = calloc(1, sizeof(sllq_t));
+#if defined(__i386__) || defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
 
-    if (queue) {
-        memcpy(queue, &_sllq_t_defaults, sizeof(sllq_t));
+    __asm__ __volatile__("mrs %0, cntvct_el0"
+                         : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static inline size_t _sllq_latency_bucket(uint64_t ticks)
+{
+    int bit;
+
+    if (ticks < _SLLQ_LATENCY_SUB) {
+        return ticks;
     }
+    bit = 63 - __builtin_clzll(ticks);
 
-    return queue;
+    return (bit - _SLLQ_LATENCY_BITS + 1) * _SLLQ_LATENCY_SUB + ((ticks >> (bit - _SLLQ_LATENCY_BITS)) & (_SLLQ_LATENCY_SUB - 1));
 }
 
-void sllq_free(sllq_t* queue)
+/* The highest tick count that ends up in the bucket */
+static inline uint64_t _sllq_latency_value(size_t bucket)
 {
-    if (queue) {
-        free(queue);
+    size_t shift;
+
+    if (bucket < _SLLQ_LATENCY_SUB) {
+        return bucket;
     }
+    shift = bucket / _SLLQ_LATENCY_SUB - 1;
+
+    return (((uint64_t)(_SLLQ_LATENCY_SUB + bucket % _SLLQ_LATENCY_SUB + 1)) << shift) - 1;
 }
 
-/*
- * Get/Set
- */
+static inline void _sllq_latency_add(sllq_t* queue, uint64_t ticks)
+{
+    _sllq_stat_add(queue, &(queue->histogram[_sllq_latency_bucket(ticks)]), 1);
+}
 
-inline sllq_mode_t sllq_mode(const sllq_t* queue)
+static inline void _sllq_latency_stamp(sllq_t* queue, size_t first, size_t n)
 {
-    sllq_assert(queue);
-    return queue->mode;
+    uint64_t now;
+
+    if (queue->stamp) {
+        now = _sllq_ticks();
+        for (; n; n--, first++) {
+            _sllq_store(&(queue->stamp[first & queue->mask]), now);
+        }
+    }
 }
 
-int sllq_set_mode(sllq_t* queue, sllq_mode_t mode)
+static inline void _sllq_latency_record(sllq_t* queue, size_t first, size_t n)
 {
-    sllq_assert(queue);
-    if (!queue) {
-        return SLLQ_EINVAL;
+    uint64_t now;
+
+    if (queue->stamp) {
+        now = _sllq_ticks();
+        for (; n; n--, first++) {
+            _sllq_latency_add(queue, now - _sllq_load(&(queue->stamp[first & queue->mask])));
+        }
     }
+}
 
-    queue->mode = mode;
+/*
+ * Version
+ */
 
-    return SLLQ_OK;
+static const char* _version = SLLQ_VERSION_STR;
+inline const char* sllq_version_str(void)
+{
+    return _version;
 }
 
-inline size_t sllq_size(const sllq_t* queue)
+inline int sllq_version_major(void)
 {
-    sllq_assert(queue);
-    return queue->size;
+    return SLLQ_VERSION_MAJOR;
 }
 
-int sllq_set_size(sllq_t* queue, size_t size)
+inline int sllq_version_minor(void)
 {
-    size_t n, bit;
+    return SLLQ_VERSION_MINOR;
+}
 
-    sllq_assert(queue);
-    if (!queue) {
+inline int sllq_version_patch(void)
+{
+    return SLLQ_VERSION_PATCH;
+}
+
+/*
+ * Time, all waiting is done against an absolute CLOCK_MONOTONIC deadline
+ */
+
+static int _sllq_deadline(const struct timespec* timeout, int flags, struct timespec* deadline)
+{
+    struct timespec now, real;
+
+    if (timeout->tv_nsec < 0 || timeout->tv_nsec > 999999999) {
         return SLLQ_EINVAL;
     }
-    sllq_assert(size);
-    if (!size) {
+
+    if (flags == SLLQ_TIMEOUT_MONOTONIC) {
+        *deadline = *timeout;
+        return SLLQ_OK;
+    }
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+        return SLLQ_ERRNO;
+    }
+
+    if (flags == SLLQ_TIMEOUT_RELATIVE) {
+        deadline->tv_sec  = now.tv_sec + timeout->tv_sec;
+        deadline->tv_nsec = now.tv_nsec + timeout->tv_nsec;
+    } else if (flags == SLLQ_TIMEOUT_REALTIME) {
+        if (clock_gettime(CLOCK_REALTIME, &real)) {
+            return SLLQ_ERRNO;
+        }
+        deadline->tv_sec  = now.tv_sec + (timeout->tv_sec - real.tv_sec);
+        deadline->tv_nsec = now.tv_nsec + (timeout->tv_nsec - real.tv_nsec);
+    } else {
         return SLLQ_EINVAL;
     }
 
-    if (queue->item) {
-        return SLLQ_EBUSY;
+    if (deadline->tv_nsec < 0) {
+        deadline->tv_sec--;
+        deadline->tv_nsec += 1000000000;
+    } else if (deadline->tv_nsec > 999999999) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+    if (deadline->tv_sec < 0) {
+        deadline->tv_sec  = 0;
+        deadline->tv_nsec = 0;
     }
 
-    for (bit = 1, n = 0; n < (sizeof(size) * 8); n++) {
-        if (bit == size)
-            break;
-        if (size & bit)
-            return SLLQ_EINVAL;
-        bit <<= 1;
+    return SLLQ_OK;
+}
+
+static int _sllq_remaining(const struct timespec* deadline, struct timespec* remaining)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+        return SLLQ_ERRNO;
     }
 
-    queue->size = bit;
-    queue->mask = size - 1;
-    if (!queue->mask)
-        queue->mask = 1;
+    remaining->tv_sec  = deadline->tv_sec - now.tv_sec;
+    remaining->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (remaining->tv_nsec < 0) {
+        remaining->tv_sec--;
+        remaining->tv_nsec += 1000000000;
+    }
+    if (remaining->tv_sec < 0 || (!remaining->tv_sec && !remaining->tv_nsec)) {
+        return SLLQ_ETIMEDOUT;
+    }
+
+    return SLLQ_OK;
+}
+
+static int _sllq_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline)
+{
+#if HAVE_PTHREAD_CONDATTR_SETCLOCK
+    return pthread_cond_timedwait(cond, mutex, deadline);
+#else
+    struct timespec remaining, abstime;
+    int             err;
+
+    if ((err = _sllq_remaining(deadline, &remaining))) {
+        return err == SLLQ_ETIMEDOUT ? ETIMEDOUT : errno;
+    }
+    if (clock_gettime(CLOCK_REALTIME, &abstime)) {
+        return errno;
+    }
+    abstime.tv_sec += remaining.tv_sec;
+    abstime.tv_nsec += remaining.tv_nsec;
+    if (abstime.tv_nsec > 999999999) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+    }
+
+    return pthread_cond_timedwait(cond, mutex, &abstime);
+#endif
+}
+
+#if !HAVE_LINUX_FUTEX_H
+static int _sllq_yield(const struct timespec* deadline)
+{
+    struct timespec remaining;
+    int             err;
+
+    if ((err = _sllq_remaining(deadline, &remaining))) {
+        return err;
+    }
+    sched_yield();
 
     return SLLQ_OK;
 }
+#endif
 
 /*
- * Init/Destroy
+ * Wait
  */
 
-int sllq_init(sllq_t* queue)
+static inline void _sllq_backoff(const sllq_t* queue, size_t n)
 {
-    sllq_assert(queue);
-    if (!queue) {
-        return SLLQ_EINVAL;
+    if (n < queue->spin) {
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield" ::: "memory");
+#else
+        __asm__ __volatile__("" ::: "memory");
+#endif
+    } else {
+        sched_yield();
     }
+}
 
-    if (queue->mode == SLLQ_MUTEX) {
-        size_t       n;
-        int          err;
-        sllq_item_t* item;
+static unsigned int _sllq_wait_prepare(sllq_wait_t* wait)
+{
+#if HAVE_LINUX_FUTEX_H
+    __atomic_fetch_add(&(wait->waiters), 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return _sllq_load_acquire(&(wait->futex));
+#else
+    return 0;
+#endif
+}
 
-        if (!queue->size) {
-            return SLLQ_EINVAL;
-        }
-        if (queue->item) {
-            return SLLQ_EBUSY;
-        }
+static void _sllq_wait_cancel(sllq_wait_t* wait)
+{
+#if HAVE_LINUX_FUTEX_H
+    __atomic_fetch_sub(&(wait->waiters), 1, __ATOMIC_RELAXED);
+#endif
+}
 
-        if (!(item = calloc(queue->size, sizeof(sllq_item_t)))) {
-            sllq_destroy(queue);
-            return SLLQ_ENOMEM;
-        }
+#define _sllq_closed(wait) _sllq_load_acquire(&((wait)->closed))
 
-        for (n = 0; n < queue->size; n++) {
-            if ((err = pthread_mutex_init(&(item[n].mutex), 0))) {
-                for (n--; n; n--) {
-                    pthread_mutex_destroy(&(item[n].mutex));
-                    pthread_cond_destroy(&(item[n].cond));
-                }
-                sllq_destroy(queue);
-                errno = err;
-                free(item);
-                return SLLQ_ERRNO;
-            }
-            if ((err = pthread_cond_init(&(item[n].cond), 0))) {
-                pthread_mutex_destroy(&(item[n].mutex));
-                for (n--; n; n--) {
-                    pthread_mutex_destroy(&(item[n].mutex));
-                    pthread_cond_destroy(&(item[n].cond));
-                }
-                sllq_destroy(queue);
-                errno = err;
-                free(item);
-                return SLLQ_ERRNO;
-            }
-        }
+/* Called after _sllq_wait_prepare(), sllq_close() wakes the wait after setting closed */
+static int _sllq_wait(sllq_wait_t* wait, unsigned int seq, const struct timespec* abstime)
+{
+#if HAVE_LINUX_FUTEX_H
+    int ret = SLLQ_OK;
 
-        queue->item  = item;
-        queue->read  = 0;
-        queue->write = 0;
+    if (_sllq_closed(wait)) {
+        __atomic_fetch_sub(&(wait->waiters), 1, __ATOMIC_RELAXED);
+        return SLLQ_CLOSED;
+    }
+    if (syscall(SYS_futex, &(wait->futex), FUTEX_WAIT_BITSET | (wait->shared ? 0 : FUTEX_PRIVATE_FLAG), seq, abstime, 0, FUTEX_BITSET_MATCH_ANY)) {
+        switch (errno) {
+        case EAGAIN:
+        case EINTR:
+            break;
 
-        return SLLQ_OK;
-    } else if (queue->mode == SLLQ_PIPE) {
-        int fd[2];
-        int flags, pipe_buf, errnum;
+        case ETIMEDOUT:
+            ret = SLLQ_ETIMEDOUT;
+            break;
 
-        if (pipe(fd)) {
-            return SLLQ_ERRNO;
+        default:
+            ret = SLLQ_ERRNO;
         }
+    }
+    __atomic_fetch_sub(&(wait->waiters), 1, __ATOMIC_RELAXED);
 
-        if ((flags = fcntl(fd[0], F_GETFL)) == -1
-            || fcntl(fd[0], F_SETFL, flags | O_NONBLOCK)) {
-            errnum = errno;
-            close(fd[0]);
-            close(fd[1]);
-            errno = errnum;
-            return SLLQ_ERRNO;
-        }
+    return ret;
+#else
+    if (_sllq_closed(wait)) {
+        return SLLQ_CLOSED;
+    }
+    return _sllq_yield(abstime);
+#endif
+}
 
-        if ((flags = fcntl(fd[1], F_GETFL)) == -1
-            || fcntl(fd[1], F_SETFL, flags | O_NONBLOCK)) {
-            errnum = errno;
-            close(fd[0]);
-            close(fd[1]);
-            errno = errnum;
-            return SLLQ_ERRNO;
-        }
+static void _sllq_wake(sllq_wait_t* wait, size_t n)
+{
+#if HAVE_LINUX_FUTEX_H
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (_sllq_load(&(wait->waiters))) {
+        __atomic_fetch_add(&(wait->futex), 1, __ATOMIC_SEQ_CST);
+        _sllq_stat_wakeup(wait);
+        syscall(SYS_futex, &(wait->futex), FUTEX_WAKE | (wait->shared ? 0 : FUTEX_PRIVATE_FLAG), n > INT_MAX ? INT_MAX : (int)n, 0, 0, 0);
+    }
+#endif
+}
 
-        errno = 0;
-        if ((pipe_buf = fpathconf(fd[1], _PC_PIPE_BUF)) < SIZEOF_VOIDP) {
-            errnum = errno;
-            close(fd[0]);
-            close(fd[1]);
-            errno = errnum;
-            if (errno)
-                return SLLQ_ERRNO;
-            return SLLQ_EINVAL;
-        }
+/*
+ * Pipe
+ */
 
-        queue->read_pipe  = fd[0];
-        queue->write_pipe = fd[1];
+#ifdef PIPE_BUF
+#define _SLLQ_PIPE_BUF PIPE_BUF
+#else
+#define _SLLQ_PIPE_BUF _POSIX_PIPE_BUF
+#endif
+#define _SLLQ_PIPE_BATCH (_SLLQ_PIPE_BUF / sizeof(void*))
 
-        return SLLQ_OK;
+/* Bytes per item and the read-ahead/coalescing buffer size in whole items */
+#define _sllq_pipe_item(queue) ((queue)->elem_size ? (queue)->elem_size : sizeof(void*))
+#define _sllq_pipe_cap(queue) ((_SLLQ_PIPE_BUF / _sllq_pipe_item(queue)) * _sllq_pipe_item(queue))
+
+/* With close_fd > -1 it is polled too, it becomes readable on sllq_close() */
+static int _sllq_poll(int fd, short events, int close_fd, const struct timespec* deadline)
+{
+    struct pollfd   pfd[2];
+    struct timespec remaining;
+    nfds_t          nfds = close_fd > -1 ? 2 : 1;
+    int             err;
+
+    if ((err = _sllq_remaining(deadline, &remaining))) {
+        return err;
     }
 
-    return SLLQ_EINVAL;
+    pfd[0].fd      = fd;
+    pfd[0].events  = events;
+    pfd[0].revents = 0;
+    pfd[1].fd      = close_fd;
+    pfd[1].events  = POLLIN;
+    pfd[1].revents = 0;
+
+#if HAVE_PPOLL
+    if ((err = ppoll(pfd, nfds, &remaining, 0)) < 0) {
+#else
+    if (remaining.tv_sec > INT_MAX / 1000 - 1) {
+        remaining.tv_sec = INT_MAX / 1000 - 1;
+    }
+    if ((err = poll(pfd, nfds, remaining.tv_sec * 1000 + (remaining.tv_nsec + 999999) / 1000000)) < 0) {
+#endif
+        return SLLQ_ERRNO;
+    } else if (!err) {
+        return SLLQ_ETIMEDOUT;
+    }
+
+    return SLLQ_OK;
 }
 
-int sllq_destroy(sllq_t* queue)
+static int _sllq_pipe_write_out(sllq_t* queue, const struct timespec* deadline)
 {
-    sllq_assert(queue);
-    if (!queue) {
-        return SLLQ_EINVAL;
+    ssize_t n;
+    int     err;
+
+    if (!queue->pipe_wlen) {
+        return SLLQ_OK;
     }
 
-    if (queue->mode == SLLQ_MUTEX) {
-        int err;
+    /* The buffer is at most PIPE_BUF so it is written whole or not at all */
+    while ((n = write(queue->write_pipe, queue->pipe_wbuf, queue->pipe_wlen)) < 0) {
+        switch (errno) {
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+            break;
 
-        if (queue->item) {
-            size_t n;
-
-            for (n = 0; n < queue->size; n++) {
-                if ((err = pthread_mutex_destroy(&(queue->item[n].mutex)))) {
-                    errno = err;
-                    return SLLQ_ERRNO;
-                }
-                if ((err = pthread_cond_destroy(&(queue->item[n].cond)))) {
-                    errno = err;
-                    return SLLQ_ERRNO;
-                }
-            }
-            free(queue->item);
-            queue->item = 0;
+        default:
+            return SLLQ_ERRNO;
         }
 
-        return SLLQ_OK;
-    } else if (queue->mode == SLLQ_PIPE) {
-        if (queue->write_pipe > -1) {
-            close(queue->write_pipe);
-            queue->write_pipe = -1;
+        if (_sllq_closed(&(queue->push_wait))) {
+            return SLLQ_CLOSED;
         }
-        if (queue->read_pipe > -1) {
-            close(queue->read_pipe);
-            queue->read_pipe = -1;
+        if (!deadline) {
+            return SLLQ_EAGAIN;
         }
-
-        return SLLQ_OK;
+        if ((err = _sllq_poll(queue->write_pipe, POLLOUT, queue->close_pipe[0], deadline))) {
+            return err;
+        }
+    }
+    if ((size_t)n != queue->pipe_wlen) {
+        close(queue->write_pipe);
+        queue->write_pipe = -1;
+        return SLLQ_ERROR;
     }
+    queue->pipe_wlen = 0;
 
-    return SLLQ_EINVAL;
+    return SLLQ_OK;
 }
 
-int sllq_flush(sllq_t* queue, sllq_item_callback_t callback)
+static int _sllq_pipe_expired(const sllq_t* queue)
 {
-    sllq_assert(queue);
-    if (!queue) {
-        return SLLQ_EINVAL;
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+        return 1;
     }
-    sllq_assert(callback);
-    if (!callback) {
-        return SLLQ_EINVAL;
+    now.tv_sec -= queue->pipe_since.tv_sec;
+    now.tv_nsec -= queue->pipe_since.tv_nsec;
+    if (now.tv_nsec < 0) {
+        now.tv_sec--;
+        now.tv_nsec += 1000000000;
     }
 
-    if (queue->mode == SLLQ_MUTEX) {
-        int err;
-
-        if (queue->item) {
-            size_t n;
-
-            for (n = 0; n < queue->size; n++) {
-                sllq_item_t* item = &(queue->item[n]);
+    return now.tv_sec > queue->pipe_delay.tv_sec
+           || (now.tv_sec == queue->pipe_delay.tv_sec && now.tv_nsec >= queue->pipe_delay.tv_nsec);
+}
 
-                if ((err = pthread_mutex_lock(&(item->mutex)))) {
-                    errno = err;
-                    return SLLQ_ERRNO;
-                }
+/*
+ * Eventfd
+ */
 
-                if (item->have_data) {
-                    callback(item->data);
-                    item->data      = 0;
-                    item->have_data = 0;
-                }
+static void _sllq_notify(sllq_t* queue)
+{
+    unsigned long long val = 1;
 
-                if ((err = pthread_mutex_unlock(&(item->mutex)))) {
-                    errno = err;
-                    return SLLQ_ERRNO;
-                }
-            }
+    /*
+     * Only the push that finds the consumer armed signals the eventfd,
+     * see _sllq_event_wait()
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (_sllq_load(&(queue->shift_wait.waiters))
+        && __atomic_exchange_n(&(queue->shift_wait.waiters), 0, __ATOMIC_SEQ_CST)) {
+        if (write(queue->event_fd, &val, sizeof(val)) != sizeof(val)) {
+            /* TODO: How to handle errors? We did a successful push */
         }
+        _sllq_stat_wakeup(&(queue->shift_wait));
+    }
+}
 
-        return SLLQ_OK;
-    } else if (queue->mode == SLLQ_PIPE) {
-        void*   data = 0;
-        ssize_t n;
-
-        if (queue->read_pipe > -1) {
-            while ((n = read(queue->read_pipe, &data, sizeof(data))) > 0) {
-                if (n != sizeof(data)) {
-                    close(queue->read_pipe);
-                    queue->read_pipe = -1;
-                    return SLLQ_ERROR;
-                }
-
-                callback(data);
-            }
+static int _sllq_event_wait(sllq_t* queue, size_t head, const struct timespec* abstime)
+{
+    unsigned long long val;
+    int                err, closed;
 
-            if (n < 0) {
-                switch (errno) {
-                case EAGAIN:
-#if EAGAIN != EWOULDBLOCK
-                case EWOULDBLOCK:
-#endif
-                    break;
+    for (;;) {
+        /*
+         * Drain the eventfd and arm before looking at the tail again, the
+         * producer signals once it sees the consumer armed and sllq_close()
+         * always does
+         */
+        if (read(queue->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+            return SLLQ_ERRNO;
+        }
+        __atomic_store_n(&(queue->shift_wait.waiters), 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-                default:
-                    return SLLQ_ERRNO;
-                }
-            }
+        closed            = _sllq_closed(&(queue->shift_wait));
+        queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+        if (head != queue->head.cache) {
+            return SLLQ_OK;
+        }
+        if (closed) {
+            return SLLQ_CLOSED;
+        }
+        if (!abstime) {
+            return SLLQ_EMPTY;
         }
 
-        return SLLQ_OK;
+        if ((err = _sllq_poll(queue->event_fd, POLLIN, -1, abstime))) {
+            return err;
+        }
+        queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+        if (head != queue->head.cache) {
+            return SLLQ_OK;
+        }
     }
-
-    return SLLQ_EINVAL;
 }
 
 /*
- * Queue write
+ * Memory, slots and messages come from calloc() unless placement is set,
+ * then they are anonymous mappings rounded up to whole (huge) pages so the
+ * length to unmap is known from the element count alone
  */
 
-int sllq_push(sllq_t* queue, void* data, const struct timespec* timespec)
+#define _SLLQ_HUGEPAGE (2 * 1024 * 1024)
+#define _SLLQ_NUMA_NODES 1024
+
+#define _sllq_mem_mapped(queue) ((queue)->numa_node > -1 || (queue)->hugepages || (queue)->prefault)
+
+static size_t _sllq_mem_len(const sllq_t* queue, size_t len)
 {
-    sllq_assert(queue);
-    if (!queue) {
-        return SLLQ_EINVAL;
+    size_t page = queue->hugepages ? _SLLQ_HUGEPAGE : (size_t)sysconf(_SC_PAGESIZE);
+
+    return (len + page - 1) & ~(page - 1);
+}
+
+static int _sllq_mem_alloc(sllq_t* queue, size_t n, size_t size, void** mem)
+{
+    void*  ptr = MAP_FAILED;
+    size_t len, page, off;
+#if HAVE_LINUX_MEMPOLICY_H
+    unsigned long nodes[_SLLQ_NUMA_NODES / (sizeof(unsigned long) * 8)] = { 0 };
+#endif
+
+    if (size && n > ((size_t)-1) / size) {
+        return SLLQ_ENOMEM;
     }
-    sllq_assert(data);
-    if (!data) {
-        return SLLQ_EINVAL;
+    if (!_sllq_mem_mapped(queue)) {
+        return (*mem = calloc(n, size)) ? SLLQ_OK : SLLQ_ENOMEM;
     }
 
-    if (queue->mode == SLLQ_MUTEX) {
-        int          err, ret = SLLQ_FULL;
-        sllq_item_t* item;
-
-        sllq_assert(queue->item);
-        if (!queue->item) {
-            return SLLQ_EINVAL;
+    len = _sllq_mem_len(queue, n * size);
+#ifdef MAP_HUGETLB
+    if (queue->hugepages) {
+        ptr = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (ptr == MAP_FAILED) {
+        /* No huge pages reserved, ask for transparent ones instead */
+        if ((ptr = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+            return SLLQ_ENOMEM;
         }
+#ifdef MADV_HUGEPAGE
+        if (queue->hugepages) {
+            madvise(ptr, len, MADV_HUGEPAGE);
+        }
+#endif
+    }
 
-        item = &(queue->item[queue->write]);
-
-        if ((err = pthread_mutex_trylock(&(item->mutex)))) {
-            if (err == EBUSY)
-                return SLLQ_EAGAIN;
-            errno = err;
+#if HAVE_LINUX_MEMPOLICY_H
+    /*
+     * Preferred and not bound so a full node spills over instead of failing,
+     * without NUMA support, where mbind() is filtered or for a node that is
+     * absent or offline (EINVAL) it is left to the kernel as with calloc()
+     */
+    if (queue->numa_node > -1) {
+        nodes[queue->numa_node / (sizeof(unsigned long) * 8)] = 1UL << (queue->numa_node % (sizeof(unsigned long) * 8));
+        if (syscall(SYS_mbind, ptr, len, MPOL_PREFERRED, nodes, _SLLQ_NUMA_NODES + 1, 0)
+            && errno != ENOSYS && errno != EPERM && errno != EINVAL) {
+            munmap(ptr, len);
             return SLLQ_ERRNO;
         }
+    }
+#endif
 
-        if (timespec) {
-            while (item->have_data) {
-                if (item->want_write) {
-                    pthread_mutex_unlock(&(item->mutex));
-                    return SLLQ_EINVAL;
-                }
-                if (item->want_read) {
-                    if ((err = pthread_cond_signal(&(item->cond)))) {
-                        pthread_mutex_unlock(&(item->mutex));
-                        errno = err;
-                        return SLLQ_ERRNO;
-                    }
-                }
-
-                item->want_write = 1;
-                err              = pthread_cond_timedwait(&(item->cond), &(item->mutex), timespec);
-                item->want_write = 0;
-
-                if (err) {
-                    pthread_mutex_unlock(&(item->mutex));
-                    if (err == ETIMEDOUT) {
-                        return SLLQ_ETIMEDOUT;
-                    }
-                    errno = err;
-                    return SLLQ_ERRNO;
-                }
-            }
+    if (queue->prefault) {
+        page = (size_t)sysconf(_SC_PAGESIZE);
+        for (off = 0; off < len; off += page) {
+            ((volatile char*)ptr)[off] = 0;
         }
+        /* Best effort, RLIMIT_MEMLOCK is often too low for large rings */
+        mlock(ptr, len);
+    }
 
-        if (!item->have_data) {
-            item->data      = data;
-            item->have_data = 1;
+    *mem = ptr;
 
-            queue->write++;
-            queue->write &= queue->mask;
+    return SLLQ_OK;
+}
 
-            if (item->want_read) {
-                /* TODO: How to handle errors? We did a successful push */
-                pthread_cond_signal(&(item->cond));
-            }
-            ret = SLLQ_OK;
-        }
+static void _sllq_mem_free(const sllq_t* queue, void* mem, size_t n, size_t size)
+{
+    if (!_sllq_mem_mapped(queue)) {
+        free(mem);
+    } else if (mem) {
+        munmap(mem, _sllq_mem_len(queue, n * size));
+    }
+}
 
-        if ((err = pthread_mutex_unlock(&(item->mutex)))) {
-            errno = err;
-            return SLLQ_ERRNO;
-        }
+/*
+ * Ring segments
+ */
 
-        return ret;
-    } else if (queue->mode == SLLQ_PIPE) {
-        ssize_t n;
+/*
+ * Consumer side slot of head in ATOMIC and EVENTFD modes. The end of a
+ * segment is stored before any item after it is published so the
+ * consumer sees it once it has seen the item.
+ */
+static void _sllq_segment_follow(sllq_t* queue, size_t head)
+{
+    sllq_segment_t* seg = queue->read_seg;
+    sllq_segment_t* next;
 
-        if (queue->write_pipe < 0) {
-            return SLLQ_EINVAL;
+    if (!seg) {
+        if (!(seg = _sllq_load_acquire(&(queue->segment)))) {
+            return;
         }
+        queue->read_seg = seg;
+    }
 
-        if ((n = write(queue->write_pipe, (void*)&data, sizeof(data))) < 0) {
-            struct pollfd pfd;
-            int           err, timeout;
-
-            switch (errno) {
-            case EAGAIN:
-#if EAGAIN != EWOULDBLOCK
-            case EWOULDBLOCK:
-#endif
-                if (timespec)
-                    break;
-                return SLLQ_EAGAIN;
-
-            default:
-                return SLLQ_ERRNO;
-            }
+    while (head == _sllq_load_acquire(&(seg->end))) {
+        next = seg->next;
+        _sllq_mem_free(queue, seg->ring, seg->mask + 1, sizeof(void*));
+        free(seg);
+        seg              = next;
+        queue->read_seg  = seg;
+        queue->read_ring = seg->ring;
+        queue->read_mask = seg->mask;
+    }
+}
 
-            pfd.fd      = queue->write_pipe;
-            pfd.events  = POLLOUT;
-            pfd.revents = 0;
+static inline void** _sllq_ring_slot(sllq_t* queue, size_t head)
+{
+    if (queue->read_seg || _sllq_load(&(queue->segment))) {
+        _sllq_segment_follow(queue, head);
+    }
 
-            timeout = timespec->tv_nsec / 1000;
-            if (timeout < 1)
-                timeout = 1;
-            else if (timeout > 999999)
-                timeout = 1000000;
+    return &(queue->read_ring[head & queue->read_mask]);
+}
 
-            if ((err = poll(&pfd, 1, timeout)) < 0) {
-                return SLLQ_ERRNO;
-            } else if (!err) {
-                return SLLQ_ETIMEDOUT;
-            }
+/* Free slots for the producer, a ring shrunk by a resize can be over full */
+static inline size_t _sllq_room(const sllq_t* queue, size_t tail)
+{
+    size_t used = tail - queue->tail.cache;
 
-            if ((n = write(queue->write_pipe, (void*)&data, sizeof(data))) < 0) {
-                switch (errno) {
-                case EAGAIN:
-#if EAGAIN != EWOULDBLOCK
-                case EWOULDBLOCK:
-#endif
-                    return SLLQ_EAGAIN;
+    return used < queue->size ? queue->size - used : 0;
+}
 
-                default:
-                    break;
-                }
-                return SLLQ_ERRNO;
-            }
-        }
-        if (n != sizeof(data)) {
-            close(queue->write_pipe);
-            queue->write_pipe = -1;
-            return SLLQ_ERROR;
-        }
+static void _sllq_segment_free(sllq_t* queue)
+{
+    sllq_segment_t* seg = queue->read_seg ? queue->read_seg : queue->segment;
+    sllq_segment_t* next;
 
-        return SLLQ_OK;
+    if (!seg) {
+        _sllq_mem_free(queue, queue->ring, queue->mask + 1, sizeof(void*));
+    }
+    for (; seg; seg = next) {
+        next = seg->next;
+        _sllq_mem_free(queue, seg->ring, seg->mask + 1, sizeof(void*));
+        free(seg);
     }
 
-    return SLLQ_EINVAL;
+    queue->ring      = 0;
+    queue->segment   = 0;
+    queue->write_seg = 0;
+    queue->read_seg  = 0;
+    queue->read_ring = 0;
+    queue->read_mask = 0;
 }
 
 /*
- * Queue read
+ * Slots
  */
 
-int sllq_shift(sllq_t* queue, void** data, const struct timespec* timespec)
+/* MUTEX mode, size slots with their mutex and condition initialized */
+static int _sllq_items_new(sllq_t* queue, size_t size, sllq_segment_t** segp)
 {
-    sllq_assert(queue);
-    if (!queue) {
-        return SLLQ_EINVAL;
+    sllq_segment_t*    seg;
+    size_t             n;
+    int                err;
+    pthread_condattr_t attr;
+
+    if (!(seg = calloc(1, sizeof(sllq_segment_t)))) {
+        return SLLQ_ENOMEM;
     }
-    sllq_assert(data);
-    if (!data) {
-        return SLLQ_EINVAL;
+    if ((err = _sllq_mem_alloc(queue, size, sizeof(sllq_item_t), (void**)&(seg->item)))) {
+        free(seg);
+        return err;
     }
+    seg->mask = size - 1;
 
-    if (queue->mode == SLLQ_MUTEX) {
-        int          err, ret = SLLQ_EMPTY;
-        sllq_item_t* item;
+    if ((err = pthread_condattr_init(&attr))) {
+        _sllq_mem_free(queue, seg->item, size, sizeof(sllq_item_t));
+        free(seg);
+        errno = err;
+        return SLLQ_ERRNO;
+    }
+#if HAVE_PTHREAD_CONDATTR_SETCLOCK
+    if ((err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC))) {
+        pthread_condattr_destroy(&attr);
+        _sllq_mem_free(queue, seg->item, size, sizeof(sllq_item_t));
+        free(seg);
+        errno = err;
+        return SLLQ_ERRNO;
+    }
+#endif
 
-        sllq_assert(queue->item);
-        if (!queue->item) {
-            return SLLQ_EINVAL;
+    for (n = 0; n < size; n++) {
+        if ((err = pthread_mutex_init(&(seg->item[n].mutex), 0))) {
+            break;
         }
+        if ((err = pthread_cond_init(&(seg->item[n].cond), &attr))) {
+            pthread_mutex_destroy(&(seg->item[n].mutex));
+            break;
+        }
+    }
+    pthread_condattr_destroy(&attr);
 
-        item = &(queue->item[queue->read]);
-
-        if ((err = pthread_mutex_trylock(&(item->mutex)))) {
-            if (err == EBUSY)
-                return SLLQ_EAGAIN;
-            errno = err;
-            return SLLQ_ERRNO;
+    if (err) {
+        while (n--) {
+            pthread_mutex_destroy(&(seg->item[n].mutex));
+            pthread_cond_destroy(&(seg->item[n].cond));
         }
+        _sllq_mem_free(queue, seg->item, size, sizeof(sllq_item_t));
+        free(seg);
+        errno = err;
+        return SLLQ_ERRNO;
+    }
 
-        if (timespec) {
-            while (!item->have_data) {
-                if (item->want_read) {
-                    pthread_mutex_unlock(&(item->mutex));
-                    return SLLQ_EINVAL;
-                }
-                if (item->want_write) {
-                    if ((err = pthread_cond_signal(&(item->cond)))) {
-                        pthread_mutex_unlock(&(item->mutex));
-                        errno = err;
-                        return SLLQ_ERRNO;
-                    }
-                }
+    *segp = seg;
 
-                item->want_read = 1;
-                err             = pthread_cond_timedwait(&(item->cond), &(item->mutex), timespec);
-                item->want_read = 0;
+    return SLLQ_OK;
+}
 
-                if (err) {
-                    pthread_mutex_unlock(&(item->mutex));
-                    if (err == ETIMEDOUT) {
-                        return SLLQ_ETIMEDOUT;
-                    }
-                    errno = err;
-                    return SLLQ_ERRNO;
-                }
-            }
-        }
+static int _sllq_items_free(sllq_t* queue, sllq_segment_t* seg)
+{
+    size_t n;
+    int    err;
 
-        if (item->have_data) {
-            *data           = item->data;
-            item->data      = 0;
-            item->have_data = 0;
+    for (n = 0; n <= seg->mask; n++) {
+        if ((err = pthread_mutex_destroy(&(seg->item[n].mutex)))) {
+            errno = err;
+            return SLLQ_ERRNO;
+        }
+        if ((err = pthread_cond_destroy(&(seg->item[n].cond)))) {
+            errno = err;
+            return SLLQ_ERRNO;
+        }
+    }
+    _sllq_mem_free(queue, seg->item, seg->mask + 1, sizeof(sllq_item_t));
+    free(seg);
 
-            queue->read++;
-            queue->read &= queue->mask;
+    return SLLQ_OK;
+}
 
-            if (item->want_write) {
-                /* TODO: How to handle errors? We did a successful shift */
-                pthread_cond_signal(&(item->cond));
-            }
+/*
+ * Slots left behind by resizes, freed by the consumer once it holds a
+ * slot of seg since it can then no longer be about to lock one of them.
+ * The resize releases the first old slot last, holding it means the
+ * resize is done with them.
+ */
+static void _sllq_items_retire(sllq_t* queue, sllq_segment_t* seg)
+{
+    sllq_segment_t *old = seg->next, *next;
 
-            ret = SLLQ_OK;
+    seg->next = 0;
+    for (; old; old = next) {
+        next = old->next;
+        if (pthread_mutex_lock(&(old->item[0].mutex))) {
+            return;
         }
+        pthread_mutex_unlock(&(old->item[0].mutex));
+        if (_sllq_items_free(queue, old)) {
+            return;
+        }
+    }
+}
 
-        if ((err = pthread_mutex_unlock(&(item->mutex)))) {
+/*
+ * Move the items to size new slots. Every old slot is held while they
+ * move so the consumer is not inside one, it checks that write_seg is
+ * unchanged once it holds a slot and starts over on the new ones if not.
+ * The old slots are linked from the new ones until the consumer retires
+ * them.
+ */
+static int _sllq_items_resize(sllq_t* queue, size_t size)
+{
+    sllq_segment_t *seg, *old = queue->write_seg;
+    size_t          n, read, depth;
+    int             err;
+
+    if ((err = _sllq_items_new(queue, size, &seg))) {
+        return err;
+    }
+
+    for (n = 0; n <= old->mask; n++) {
+        if ((err = pthread_mutex_lock(&(old->item[n].mutex)))) {
+            while (n--) {
+                pthread_mutex_unlock(&(old->item[n].mutex));
+            }
+            _sllq_items_free(queue, seg);
             errno = err;
             return SLLQ_ERRNO;
         }
+    }
 
-        return ret;
-    } else if (queue->mode == SLLQ_PIPE) {
-        void*   _data = 0;
-        ssize_t n;
+    read  = queue->read;
+    depth = (queue->write - read) & old->mask;
+    if (!depth && old->item[read].have_data) {
+        depth = old->mask + 1;
+    }
 
-        if (queue->read_pipe < 0) {
+    if (depth > size) {
+        for (n = 0; n <= old->mask; n++) {
+            pthread_mutex_unlock(&(old->item[n].mutex));
+        }
+        _sllq_items_free(queue, seg);
+        return SLLQ_FULL;
+    }
+
+    for (n = 0; n < depth; n++) {
+        sllq_item_t* item = &(old->item[(read + n) & old->mask]);
+
+        seg->item[n].data      = item->data;
+        seg->item[n].have_data = 1;
+        item->data             = 0;
+        item->have_data        = 0;
+    }
+
+    seg->next = old;
+    _sllq_store(&(queue->read), 0);
+    queue->write = depth & seg->mask;
+    queue->item  = seg->item;
+    queue->mask  = seg->mask;
+    queue->size  = size;
+    _sllq_store_release(&(queue->write_seg), seg);
+
+    /*
+     * A consumer waiting on an old slot wakes up to find it stale, the
+     * first slot goes last and old is not touched after it
+     */
+    for (n = old->mask + 1; n--;) {
+        if (old->item[n].want_read) {
+            pthread_cond_broadcast(&(old->item[n].cond));
+        }
+        pthread_mutex_unlock(&(old->item[n].mutex));
+    }
+
+    return SLLQ_OK;
+}
+
+/*
+ * Messages
+ */
+
+#define _sllq_msg_slot(queue, n) ((queue)->msg + ((n) & (queue)->mask) * (queue)->stride)
+
+static int _sllq_msg_alloc(sllq_t* queue)
+{
+    void* msg;
+    int   err;
+
+    if (queue->stride > ((size_t)-1) / queue->size) {
+        return SLLQ_ENOMEM;
+    }
+    if (_sllq_mem_mapped(queue)) {
+        if ((err = _sllq_mem_alloc(queue, queue->size, queue->stride, &msg))) {
+            return err;
+        }
+    } else {
+        if (posix_memalign(&msg, SLLQ_CACHELINE, queue->size * queue->stride)) {
+            return SLLQ_ENOMEM;
+        }
+        memset(msg, 0, queue->size * queue->stride);
+    }
+    queue->msg = msg;
+
+    return SLLQ_OK;
+}
+
+/*
+ * Shared memory
+ */
+
+#define _SLLQ_SHM_HDR ((sizeof(sllq_shm_t) + SLLQ_CACHELINE - 1) & ~((size_t)SLLQ_CACHELINE - 1))
+
+static int _sllq_shm_map(sllq_t* queue, int fd, int create, size_t stride)
+{
+    sllq_shm_t* shm;
+    struct stat st;
+    size_t      len = _SLLQ_SHM_HDR + queue->size * stride;
+
+    if (create) {
+        if (ftruncate(fd, len)) {
+            return SLLQ_ERRNO;
+        }
+    } else {
+        if (fstat(fd, &st)) {
+            return SLLQ_ERRNO;
+        }
+        /* The creator may not have sized the segment yet */
+        if ((size_t)st.st_size < _SLLQ_SHM_HDR) {
+            return SLLQ_EAGAIN;
+        }
+        if ((size_t)st.st_size != len) {
             return SLLQ_EINVAL;
         }
+    }
 
-        if ((n = read(queue->read_pipe, &_data, sizeof(_data))) < 0) {
-            struct pollfd pfd;
-            int           err, timeout;
+    if ((shm = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        return SLLQ_ERRNO;
+    }
 
-            switch (errno) {
-            case EAGAIN:
-#if EAGAIN != EWOULDBLOCK
-            case EWOULDBLOCK:
-#endif
-                if (timespec)
-                    break;
-                return SLLQ_EAGAIN;
+    if (create) {
+        shm->size              = queue->size;
+        shm->elem_size         = queue->elem_size;
+        shm->push_wait.shared  = 1;
+        shm->shift_wait.shared = 1;
+        _sllq_store_release(&(shm->magic), SLLQ_SHM_MAGIC);
+    } else {
+        /* The creator may not have filled in the control block yet */
+        if (_sllq_load_acquire(&(shm->magic)) != SLLQ_SHM_MAGIC) {
+            munmap(shm, len);
+            return SLLQ_EAGAIN;
+        }
+        if (shm->size != queue->size || shm->elem_size != queue->elem_size) {
+            munmap(shm, len);
+            return SLLQ_EINVAL;
+        }
+    }
 
-            default:
-                return SLLQ_ERRNO;
-            }
+    queue->shm         = shm;
+    queue->shm_size    = len;
+    queue->shm_created = create;
+    queue->msg         = (char*)shm + _SLLQ_SHM_HDR;
+    queue->stride      = stride;
 
-            pfd.fd      = queue->read_pipe;
-            pfd.events  = POLLIN;
-            pfd.revents = 0;
+    return SLLQ_OK;
+}
 
-            timeout = timespec->tv_nsec / 1000;
-            if (timeout < 1)
-                timeout = 1;
-            else if (timeout > 999999)
-                timeout = 1000000;
+static int _sllq_shm_init(sllq_t* queue)
+{
+    struct stat st;
+    size_t      stride;
+    int         fd, create = 0, err;
 
-            if ((err = poll(&pfd, 1, timeout)) < 0) {
-                return SLLQ_ERRNO;
-            } else if (!err) {
-                return SLLQ_ETIMEDOUT;
-            }
+    if (queue->size < 2) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->shm) {
+        return SLLQ_EBUSY;
+    }
 
-            if ((n = read(queue->read_pipe, &_data, sizeof(_data))) < 0) {
-                switch (errno) {
-                case EAGAIN:
-#if EAGAIN != EWOULDBLOCK
-                case EWOULDBLOCK:
+    stride = queue->elem_size ? queue->stride : sizeof(void*);
+    if (stride > (((size_t)-1) - _SLLQ_SHM_HDR) / queue->size) {
+        return SLLQ_ENOMEM;
+    }
+
+    if ((fd = queue->shm_fd) > -1) {
+        if (fstat(fd, &st)) {
+            return SLLQ_ERRNO;
+        }
+        create = !st.st_size;
+    } else if (queue->shm_name) {
+#if HAVE_SHM_OPEN
+        if ((fd = shm_open(queue->shm_name, O_RDWR | O_CREAT | O_EXCL, 0600)) > -1) {
+            create = 1;
+        } else if (errno != EEXIST || (fd = shm_open(queue->shm_name, O_RDWR, 0)) < 0) {
+            return SLLQ_ERRNO;
+        }
+#else
+        return SLLQ_EINVAL;
+#endif
+    } else {
+#if HAVE_MEMFD_CREATE
+        if ((fd = memfd_create("sllq", MFD_CLOEXEC)) < 0) {
+            return SLLQ_ERRNO;
+        }
+        create = 1;
+#else
+        return SLLQ_EINVAL;
 #endif
-                    return SLLQ_EAGAIN;
+    }
 
-                default:
-                    break;
-                }
-                return SLLQ_ERRNO;
+    if ((err = _sllq_shm_map(queue, fd, create, stride))) {
+        if (fd != queue->shm_fd) {
+            int errnum = errno;
+
+#if HAVE_SHM_OPEN
+            if (create && queue->shm_name) {
+                shm_unlink(queue->shm_name);
             }
+#endif
+            close(fd);
+            errno = errnum;
         }
-        if (n != sizeof(_data)) {
-            close(queue->read_pipe);
-            queue->read_pipe = -1;
-            return SLLQ_ERROR;
+        return err;
+    }
+    queue->shm_fd = fd;
+
+    return SLLQ_OK;
+}
+
+static void _sllq_shm_destroy(sllq_t* queue)
+{
+    if (queue->shm) {
+        munmap(queue->shm, queue->shm_size);
+        queue->shm = 0;
+        queue->msg = 0;
+#if HAVE_SHM_OPEN
+        if (queue->shm_created && queue->shm_name) {
+            shm_unlink(queue->shm_name);
         }
+#endif
+        queue->shm_created = 0;
+    }
+    if (queue->shm_fd > -1) {
+        close(queue->shm_fd);
+        queue->shm_fd = -1;
+    }
+}
 
-        *data = _data;
+/*
+ * New/Free
+ */
 
-        return SLLQ_OK;
+static sllq_t _sllq_t_defaults = SLLQ_T_INIT;
+
+sllq_t* sllq_new(void)
+{
+    sllq_t* queue = calloc(1, sizeof(sllq_t));
+
+    if (queue) {
+        memcpy(queue, &_sllq_t_defaults, sizeof(sllq_t));
     }
 
-    return SLLQ_EINVAL;
+    return queue;
+}
+
+void sllq_free(sllq_t* queue)
+{
+    if (queue) {
+        free(queue);
+    }
+}
+
+/*
+ * Get/Set
+ */
+
+inline sllq_mode_t sllq_mode(const sllq_t* queue)
+{
+    sllq_assert(queue);
+    return queue->mode;
+}
+
+int sllq_set_mode(sllq_t* queue, sllq_mode_t mode)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    queue->mode = mode;
+
+    return SLLQ_OK;
+}
+
+inline size_t sllq_size(const sllq_t* queue)
+{
+    sllq_assert(queue);
+    return queue->size;
+}
+
+int sllq_set_size(sllq_t* queue, size_t size)
+{
+    size_t n, bit;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(size);
+    if (!size) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->item || queue->ring || queue->cell || queue->shm || queue->lane) {
+        return SLLQ_EBUSY;
+    }
+
+    for (bit = 1, n = 0; n < (sizeof(size) * 8); n++) {
+        if (bit == size)
+            break;
+        if (size & bit)
+            return SLLQ_EINVAL;
+        bit <<= 1;
+    }
+
+    queue->size = bit;
+    queue->mask = size - 1;
+    if (!queue->mask)
+        queue->mask = 1;
+
+    return SLLQ_OK;
+}
+
+int sllq_resize(sllq_t* queue, size_t size)
+{
+    sllq_segment_t *seg, *first = 0;
+    size_t          tail;
+    int             err;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    if (!queue->item && !queue->ring && !queue->cell && !queue->shm && !queue->lane) {
+        return sllq_set_size(queue, size);
+    }
+    if (queue->lane || (queue->mode != SLLQ_MUTEX && queue->mode != SLLQ_ATOMIC && queue->mode != SLLQ_EVENTFD)) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->msg || queue->stamp) {
+        return SLLQ_EINVAL;
+    }
+    if (size < 2 || (size & (size - 1))) {
+        return SLLQ_EINVAL;
+    }
+    if (size == queue->size) {
+        return SLLQ_OK;
+    }
+    if (queue->mode == SLLQ_MUTEX) {
+        return _sllq_items_resize(queue, size);
+    }
+
+    if (!(seg = calloc(1, sizeof(sllq_segment_t)))) {
+        return SLLQ_ENOMEM;
+    }
+    if ((err = _sllq_mem_alloc(queue, size, sizeof(void*), (void**)&(seg->ring)))) {
+        free(seg);
+        return err;
+    }
+    seg->mask = size - 1;
+    seg->end  = (size_t)-1;
+
+    /* The first resize puts the ring from init in a segment of its own */
+    if (!queue->write_seg) {
+        if (!(first = calloc(1, sizeof(sllq_segment_t)))) {
+            _sllq_mem_free(queue, seg->ring, size, sizeof(void*));
+            free(seg);
+            return SLLQ_ENOMEM;
+        }
+        first->ring      = queue->ring;
+        first->mask      = queue->mask;
+        first->end       = (size_t)-1;
+        queue->write_seg = first;
+    }
+
+    /*
+     * Link the new segment before the end is stored and publish the first
+     * segment before anything is pushed to the new one. Must be called by
+     * the producer, tail does not move under us.
+     */
+    tail                  = queue->tail.index;
+    queue->write_seg->next = seg;
+    _sllq_store_release(&(queue->write_seg->end), tail);
+    if (first) {
+        _sllq_store_release(&(queue->segment), first);
+    }
+    queue->write_seg = seg;
+    queue->ring      = seg->ring;
+    queue->mask      = seg->mask;
+    queue->size      = size;
+
+    return SLLQ_OK;
+}
+
+int sllq_set_wait(sllq_t* queue, size_t spin, size_t yield)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    queue->spin  = spin;
+    queue->yield = yield;
+
+    return SLLQ_OK;
+}
+
+inline size_t sllq_elem_size(const sllq_t* queue)
+{
+    sllq_assert(queue);
+    return queue->elem_size;
+}
+
+int sllq_set_elem_size(sllq_t* queue, size_t elem_size)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->item || queue->ring || queue->cell || queue->read_pipe > -1 || queue->shm || queue->lane) {
+        return SLLQ_EBUSY;
+    }
+
+    /* Whole cache lines so a producer and consumer never share one */
+    queue->elem_size = elem_size;
+    queue->stride    = (elem_size + SLLQ_CACHELINE - 1) & ~((size_t)SLLQ_CACHELINE - 1);
+
+    return SLLQ_OK;
+}
+
+int sllq_set_pipe_readahead(sllq_t* queue, int readahead)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->read_pipe > -1) {
+        return SLLQ_EBUSY;
+    }
+
+    queue->pipe_readahead = readahead ? 1 : 0;
+
+    return SLLQ_OK;
+}
+
+int sllq_set_pipe_coalesce(sllq_t* queue, const struct timespec* delay)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->write_pipe > -1) {
+        return SLLQ_EBUSY;
+    }
+
+    if (!delay) {
+        queue->pipe_coalesce = 0;
+        return SLLQ_OK;
+    }
+    if (delay->tv_sec < 0 || delay->tv_nsec < 0 || delay->tv_nsec > 999999999) {
+        return SLLQ_EINVAL;
+    }
+
+    queue->pipe_coalesce = 1;
+    queue->pipe_delay    = *delay;
+
+    return SLLQ_OK;
+}
+
+int sllq_set_shm_name(sllq_t* queue, const char* name)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->shm) {
+        return SLLQ_EBUSY;
+    }
+
+    queue->shm_name = name;
+
+    return SLLQ_OK;
+}
+
+int sllq_set_shm_fd(sllq_t* queue, int fd)
+{
+    int dup_fd;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(fd > -1);
+    if (fd < 0) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->shm) {
+        return SLLQ_EBUSY;
+    }
+
+    /* The queue keeps its own descriptor and closes it on destroy */
+    if ((dup_fd = dup(fd)) < 0) {
+        return SLLQ_ERRNO;
+    }
+    if (queue->shm_fd > -1) {
+        close(queue->shm_fd);
+    }
+    queue->shm_fd = dup_fd;
+
+    return SLLQ_OK;
+}
+
+int sllq_set_latency(sllq_t* queue, int latency)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->item || queue->ring || queue->cell || queue->shm || queue->read_pipe > -1 || queue->lane) {
+        return SLLQ_EBUSY;
+    }
+
+    queue->latency = latency ? 1 : 0;
+
+    return SLLQ_OK;
+}
+
+inline size_t sllq_lanes(const sllq_t* queue)
+{
+    sllq_assert(queue);
+    return queue->lanes ? queue->lanes : 1;
+}
+
+int sllq_set_lanes(sllq_t* queue, size_t lanes)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(lanes);
+    if (!lanes) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->item || queue->ring || queue->cell || queue->shm || queue->read_pipe > -1 || queue->lane) {
+        return SLLQ_EBUSY;
+    }
+
+    queue->lanes = lanes > 1 ? lanes : 0;
+
+    return SLLQ_OK;
+}
+
+int sllq_set_numa_node(sllq_t* queue, int node)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(node >= -1 && node < _SLLQ_NUMA_NODES);
+    if (node < -1 || node >= _SLLQ_NUMA_NODES) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->item || queue->ring || queue->cell || queue->shm || queue->read_pipe > -1 || queue->lane) {
+        return SLLQ_EBUSY;
+    }
+
+    queue->numa_node = node;
+
+    return SLLQ_OK;
+}
+
+int sllq_set_hugepages(sllq_t* queue, int hugepages)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->item || queue->ring || queue->cell || queue->shm || queue->read_pipe > -1 || queue->lane) {
+        return SLLQ_EBUSY;
+    }
+
+    queue->hugepages = hugepages ? 1 : 0;
+
+    return SLLQ_OK;
+}
+
+int sllq_set_prefault(sllq_t* queue, int prefault)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->item || queue->ring || queue->cell || queue->shm || queue->read_pipe > -1 || queue->lane) {
+        return SLLQ_EBUSY;
+    }
+
+    queue->prefault = prefault ? 1 : 0;
+
+    return SLLQ_OK;
+}
+
+int sllq_fd(const sllq_t* queue)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return -1;
+    }
+
+    if (queue->mode == SLLQ_PIPE) {
+        return queue->read_pipe;
+    } else if (queue->mode == SLLQ_EVENTFD) {
+        return queue->event_fd;
+    } else if (queue->mode == SLLQ_SHM) {
+        return queue->shm_fd;
+    }
+
+    return -1;
+}
+
+/*
+ * Init/Destroy
+ */
+
+static int _sllq_init(sllq_t* queue)
+{
+
+    if (queue->mode == SLLQ_MUTEX) {
+        int err;
+
+        if (!queue->size) {
+            return SLLQ_EINVAL;
+        }
+        if (queue->item) {
+            return SLLQ_EBUSY;
+        }
+
+        if ((err = _sllq_items_new(queue, queue->size, &(queue->write_seg)))) {
+            sllq_destroy(queue);
+            return err;
+        }
+
+        queue->item  = queue->write_seg->item;
+        queue->read  = 0;
+        queue->write = 0;
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_PIPE) {
+        int fd[2];
+        int flags, pipe_buf, errnum;
+
+        if (pipe(fd)) {
+            return SLLQ_ERRNO;
+        }
+
+        if ((flags = fcntl(fd[0], F_GETFL)) == -1
+            || fcntl(fd[0], F_SETFL, flags | O_NONBLOCK)) {
+            errnum = errno;
+            close(fd[0]);
+            close(fd[1]);
+            errno = errnum;
+            return SLLQ_ERRNO;
+        }
+
+        if ((flags = fcntl(fd[1], F_GETFL)) == -1
+            || fcntl(fd[1], F_SETFL, flags | O_NONBLOCK)) {
+            errnum = errno;
+            close(fd[0]);
+            close(fd[1]);
+            errno = errnum;
+            return SLLQ_ERRNO;
+        }
+
+        errno = 0;
+        if ((pipe_buf = fpathconf(fd[1], _PC_PIPE_BUF)) < SIZEOF_VOIDP
+            || (size_t)pipe_buf < queue->elem_size
+            || queue->elem_size > _SLLQ_PIPE_BUF) {
+            errnum = errno;
+            close(fd[0]);
+            close(fd[1]);
+            errno = errnum;
+            if (errno)
+                return SLLQ_ERRNO;
+            return SLLQ_EINVAL;
+        }
+
+#ifdef F_SETPIPE_SZ
+        /*
+         * Best effort, unprivileged processes can not go above
+         * /proc/sys/fs/pipe-max-size and the kernel rounds up to pages
+         */
+        if (queue->size) {
+            size_t bytes = queue->size * _sllq_pipe_item(queue);
+
+            if (bytes / _sllq_pipe_item(queue) != queue->size || bytes > INT_MAX) {
+                bytes = INT_MAX;
+            }
+            fcntl(fd[1], F_SETPIPE_SZ, (int)bytes);
+        }
+#endif
+
+        if ((queue->pipe_readahead && !(queue->pipe_rbuf = malloc(_sllq_pipe_cap(queue))))
+            || (queue->pipe_coalesce && !(queue->pipe_wbuf = malloc(_sllq_pipe_cap(queue))))) {
+            free(queue->pipe_rbuf);
+            queue->pipe_rbuf = 0;
+            close(fd[0]);
+            close(fd[1]);
+            return SLLQ_ENOMEM;
+        }
+        if (pipe(queue->close_pipe)) {
+            errnum = errno;
+            free(queue->pipe_rbuf);
+            free(queue->pipe_wbuf);
+            queue->pipe_rbuf     = 0;
+            queue->pipe_wbuf     = 0;
+            queue->close_pipe[0] = -1;
+            queue->close_pipe[1] = -1;
+            close(fd[0]);
+            close(fd[1]);
+            errno = errnum;
+            return SLLQ_ERRNO;
+        }
+        queue->pipe_rpos = 0;
+        queue->pipe_rlen = 0;
+        queue->pipe_wlen = 0;
+
+        queue->read_pipe  = fd[0];
+        queue->write_pipe = fd[1];
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_ATOMIC || queue->mode == SLLQ_EVENTFD || queue->mode == SLLQ_STEAL) {
+        int err;
+
+        if (queue->size < 2) {
+            return SLLQ_EINVAL;
+        }
+        if (queue->ring) {
+            return SLLQ_EBUSY;
+        }
+
+        if (queue->mode == SLLQ_EVENTFD) {
+#if HAVE_SYS_EVENTFD_H
+            if ((queue->event_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+                return SLLQ_ERRNO;
+            }
+#else
+            return SLLQ_EINVAL;
+#endif
+        }
+
+        if ((err = _sllq_mem_alloc(queue, queue->size, sizeof(void*), (void**)&(queue->ring)))) {
+            if (queue->event_fd > -1) {
+                close(queue->event_fd);
+                queue->event_fd = -1;
+            }
+            return err;
+        }
+
+        queue->read_ring  = queue->ring;
+        queue->read_mask  = queue->mask;
+        queue->head.index = 0;
+        queue->head.cache = 0;
+        queue->tail.index = 0;
+        queue->tail.cache = 0;
+        queue->head.held  = 0;
+        queue->tail.held  = 0;
+
+        /* The consumer starts out waiting on an empty queue */
+        queue->shift_wait.waiters = queue->mode == SLLQ_EVENTFD;
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_MPMC) {
+        size_t n;
+        int    err;
+
+        if (queue->size < 2) {
+            return SLLQ_EINVAL;
+        }
+        if (queue->cell) {
+            return SLLQ_EBUSY;
+        }
+
+        if ((err = _sllq_mem_alloc(queue, queue->size, sizeof(sllq_cell_t), (void**)&(queue->cell)))) {
+            return err;
+        }
+
+        for (n = 0; n < queue->size; n++) {
+            queue->cell[n].seq = n;
+        }
+        queue->head.index = 0;
+        queue->tail.index = 0;
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_SHM) {
+        return _sllq_shm_init(queue);
+    }
+
+    return SLLQ_EINVAL;
+}
+
+static int _sllq_lanes_init(sllq_t* queue)
+{
+    size_t n;
+    int    err;
+
+    if (!queue->size) {
+        return SLLQ_EINVAL;
+    }
+    if (!(queue->lane = calloc(queue->lanes, sizeof(sllq_t)))) {
+        return SLLQ_ENOMEM;
+    }
+
+    for (n = 0; n < queue->lanes; n++) {
+        sllq_t* lane = &(queue->lane[n]);
+
+        memcpy(lane, &_sllq_t_defaults, sizeof(sllq_t));
+        lane->mode      = queue->mode;
+        lane->size      = queue->size;
+        lane->mask      = queue->mask;
+        lane->spin      = queue->spin;
+        lane->yield     = queue->yield;
+        lane->numa_node = queue->numa_node;
+        lane->hugepages = queue->hugepages;
+        lane->prefault  = queue->prefault;
+
+        if ((err = _sllq_init(lane))) {
+            while (n--) {
+                sllq_destroy(&(queue->lane[n]));
+            }
+            free(queue->lane);
+            queue->lane = 0;
+            return err;
+        }
+    }
+
+    return SLLQ_OK;
+}
+
+int sllq_init(sllq_t* queue)
+{
+    int err;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->elem_size && queue->mode == SLLQ_STEAL) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->latency && (queue->mode == SLLQ_PIPE || queue->mode == SLLQ_SHM)) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->msg || queue->stamp || queue->lane) {
+        return SLLQ_EBUSY;
+    }
+
+#if SLLQ_STATS
+    queue->stats = 1;
+#endif
+
+    if (queue->lanes) {
+        if (queue->mode != SLLQ_MUTEX && queue->mode != SLLQ_ATOMIC && queue->mode != SLLQ_MPMC) {
+            return SLLQ_EINVAL;
+        }
+        if (queue->elem_size || queue->latency) {
+            return SLLQ_EINVAL;
+        }
+        return _sllq_lanes_init(queue);
+    }
+
+    if ((err = _sllq_init(queue))) {
+        return err;
+    }
+
+    if (queue->elem_size && queue->mode != SLLQ_PIPE && queue->mode != SLLQ_SHM) {
+        if ((err = _sllq_msg_alloc(queue))) {
+            sllq_destroy(queue);
+            return err;
+        }
+    }
+
+    if (queue->latency) {
+        if (!(queue->stamp = calloc(queue->size, sizeof(uint64_t)))
+            || !(queue->histogram = calloc(_SLLQ_LATENCY_BUCKETS, sizeof(size_t)))) {
+            sllq_destroy(queue);
+            return SLLQ_ENOMEM;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &(queue->latency_time));
+        queue->latency_ticks = _sllq_ticks();
+    }
+
+    return SLLQ_OK;
+}
+
+int sllq_destroy(sllq_t* queue)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    queue->push_wait.closed  = 0;
+    queue->shift_wait.closed = 0;
+
+    if (queue->msg && queue->mode != SLLQ_SHM) {
+        if (_sllq_mem_mapped(queue)) {
+            _sllq_mem_free(queue, queue->msg, queue->size, queue->stride);
+        } else {
+            free(queue->msg);
+        }
+        queue->msg = 0;
+    }
+    if (queue->stamp) {
+        free(queue->stamp);
+        queue->stamp = 0;
+    }
+    if (queue->histogram) {
+        free(queue->histogram);
+        queue->histogram = 0;
+    }
+
+    if (queue->lane) {
+        size_t n;
+        int    err;
+
+        for (n = 0; n < queue->lanes; n++) {
+            if ((err = sllq_destroy(&(queue->lane[n])))) {
+                return err;
+            }
+        }
+        free(queue->lane);
+        queue->lane = 0;
+
+        return SLLQ_OK;
+    }
+
+    if (queue->mode == SLLQ_MUTEX) {
+        int err;
+
+        while (queue->write_seg) {
+            sllq_segment_t* next = queue->write_seg->next;
+
+            if ((err = _sllq_items_free(queue, queue->write_seg))) {
+                return err;
+            }
+            queue->write_seg = next;
+        }
+        queue->item = 0;
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_PIPE) {
+        if (queue->write_pipe > -1) {
+            close(queue->write_pipe);
+            queue->write_pipe = -1;
+        }
+        if (queue->read_pipe > -1) {
+            close(queue->read_pipe);
+            queue->read_pipe = -1;
+        }
+        if (queue->pipe_rbuf) {
+            free(queue->pipe_rbuf);
+            queue->pipe_rbuf = 0;
+        }
+        if (queue->pipe_wbuf) {
+            free(queue->pipe_wbuf);
+            queue->pipe_wbuf = 0;
+        }
+        if (queue->close_pipe[0] > -1) {
+            close(queue->close_pipe[0]);
+            close(queue->close_pipe[1]);
+            queue->close_pipe[0] = -1;
+            queue->close_pipe[1] = -1;
+        }
+        queue->pipe_rpos = 0;
+        queue->pipe_rlen = 0;
+        queue->pipe_wlen = 0;
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_ATOMIC || queue->mode == SLLQ_EVENTFD || queue->mode == SLLQ_STEAL) {
+        if (queue->ring) {
+            _sllq_segment_free(queue);
+        }
+        if (queue->event_fd > -1) {
+            close(queue->event_fd);
+            queue->event_fd = -1;
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_MPMC) {
+        if (queue->cell) {
+            _sllq_mem_free(queue, queue->cell, queue->size, sizeof(sllq_cell_t));
+            queue->cell = 0;
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_SHM) {
+        _sllq_shm_destroy(queue);
+
+        return SLLQ_OK;
+    }
+
+    return SLLQ_EINVAL;
+}
+
+/*
+ * Pushes fail with SLLQ_CLOSED from now on and shifts once the queue is
+ * empty, everyone waiting is woken to find out
+ */
+int sllq_close(sllq_t* queue)
+{
+    sllq_wait_t *      push_wait, *shift_wait;
+    unsigned long long val = 1;
+    size_t             n;
+    int                err;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (!queue->item && !queue->ring && !queue->cell && !queue->shm && queue->read_pipe < 0 && !queue->lane) {
+        return SLLQ_EINVAL;
+    }
+
+    /* The lanes first, see _sllq_lanes_shift() */
+    if (queue->lane) {
+        for (n = 0; n < queue->lanes; n++) {
+            if ((err = sllq_close(&(queue->lane[n])))) {
+                return err;
+            }
+        }
+    }
+
+    /* Coalesced pushes go out first so a consumer gets them before SLLQ_CLOSED */
+    if (queue->mode == SLLQ_PIPE && queue->write_pipe > -1 && (err = _sllq_pipe_write_out(queue, 0))) {
+        return err;
+    }
+
+    push_wait  = queue->shm ? &(queue->shm->push_wait) : &(queue->push_wait);
+    shift_wait = queue->shm ? &(queue->shm->shift_wait) : &(queue->shift_wait);
+    if (__atomic_exchange_n(&(push_wait->closed), 1, __ATOMIC_SEQ_CST)) {
+        return SLLQ_OK;
+    }
+    __atomic_store_n(&(shift_wait->closed), 1, __ATOMIC_SEQ_CST);
+
+    if (queue->mode == SLLQ_MUTEX && queue->item) {
+        sllq_segment_t* seg = _sllq_load_acquire(&(queue->write_seg));
+
+        for (n = 0; n <= seg->mask; n++) {
+            sllq_item_t* item = &(seg->item[n]);
+
+            if ((err = pthread_mutex_lock(&(item->mutex)))) {
+                errno = err;
+                return SLLQ_ERRNO;
+            }
+            if (item->want_read || item->want_write) {
+                pthread_cond_broadcast(&(item->cond));
+            }
+            pthread_mutex_unlock(&(item->mutex));
+        }
+    } else if (queue->mode == SLLQ_PIPE) {
+        if (write(queue->close_pipe[1], &val, 1) != 1) {
+            return SLLQ_ERRNO;
+        }
+    } else if (queue->mode == SLLQ_EVENTFD) {
+        if (write(queue->event_fd, &val, sizeof(val)) != sizeof(val)) {
+            return SLLQ_ERRNO;
+        }
+    }
+
+    _sllq_wake(push_wait, (size_t)-1);
+    _sllq_wake(shift_wait, (size_t)-1);
+
+    return SLLQ_OK;
+}
+
+int sllq_flush(sllq_t* queue, sllq_item_callback_t callback)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(callback);
+    if (!callback) {
+        return SLLQ_EINVAL;
+    }
+
+    /* Highest priority first, the order they would have been shifted in */
+    if (queue->lane) {
+        size_t n;
+        int    err;
+
+        for (n = queue->lanes; n--;) {
+            if ((err = sllq_flush(&(queue->lane[n]), callback))) {
+                return err;
+            }
+        }
+
+        return SLLQ_OK;
+    }
+
+    if (queue->mode == SLLQ_MUTEX) {
+        int err;
+
+        if (queue->item) {
+            size_t n;
+
+            for (n = 0; n < queue->size; n++) {
+                sllq_item_t* item = &(queue->item[n]);
+
+                if ((err = pthread_mutex_lock(&(item->mutex)))) {
+                    errno = err;
+                    return SLLQ_ERRNO;
+                }
+
+                if (item->have_data) {
+                    callback(queue->msg ? _sllq_msg_slot(queue, n) : item->data);
+                    item->data      = 0;
+                    item->have_data = 0;
+                }
+
+                if ((err = pthread_mutex_unlock(&(item->mutex)))) {
+                    errno = err;
+                    return SLLQ_ERRNO;
+                }
+            }
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_PIPE) {
+        void*   data = 0;
+        void*   buf  = &data;
+        size_t  len  = sizeof(data);
+        ssize_t n;
+
+        if (queue->read_pipe > -1) {
+            for (; queue->pipe_rpos < queue->pipe_rlen; queue->pipe_rpos += _sllq_pipe_item(queue)) {
+                if (queue->elem_size) {
+                    callback(queue->pipe_rbuf + queue->pipe_rpos);
+                } else {
+                    memcpy(&data, queue->pipe_rbuf + queue->pipe_rpos, sizeof(data));
+                    callback(data);
+                }
+            }
+
+            if (queue->elem_size) {
+                if (!(buf = malloc(queue->elem_size))) {
+                    return SLLQ_ENOMEM;
+                }
+                len = queue->elem_size;
+            }
+
+            while ((n = read(queue->read_pipe, buf, len)) > 0) {
+                if ((size_t)n != len) {
+                    close(queue->read_pipe);
+                    queue->read_pipe = -1;
+                    if (buf != &data)
+                        free(buf);
+                    return SLLQ_ERROR;
+                }
+
+                callback(buf == &data ? data : buf);
+            }
+
+            if (buf != &data)
+                free(buf);
+
+            if (n < 0) {
+                switch (errno) {
+                case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                    break;
+
+                default:
+                    return SLLQ_ERRNO;
+                }
+            }
+        }
+
+        /* Items still coalesced on the producer side were never written */
+        for (len = 0; len < queue->pipe_wlen; len += _sllq_pipe_item(queue)) {
+            if (queue->elem_size) {
+                callback(queue->pipe_wbuf + len);
+            } else {
+                memcpy(&data, queue->pipe_wbuf + len, sizeof(data));
+                callback(data);
+            }
+        }
+        queue->pipe_wlen = 0;
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_ATOMIC || queue->mode == SLLQ_EVENTFD) {
+        if (queue->ring) {
+            size_t head = queue->head.index;
+            size_t tail = _sllq_load_acquire(&(queue->tail.index));
+
+            for (; head != tail; head++) {
+                callback(queue->msg ? _sllq_msg_slot(queue, head) : *_sllq_ring_slot(queue, head));
+                _sllq_store_release(&(queue->head.index), head + 1);
+            }
+            queue->head.cache = tail;
+            _sllq_wake(&(queue->push_wait), 1);
+
+            if (queue->mode == SLLQ_EVENTFD) {
+                int err = _sllq_event_wait(queue, tail, 0);
+
+                if (err != SLLQ_OK && err != SLLQ_EMPTY && err != SLLQ_CLOSED) {
+                    return err;
+                }
+            }
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_MPMC) {
+        sllq_cell_t* cell;
+        size_t       pos;
+
+        if (queue->cell) {
+            pos = _sllq_load(&(queue->head.index));
+            for (;;) {
+                cell = &(queue->cell[pos & queue->mask]);
+                if (_sllq_load_acquire(&(cell->seq)) != pos + 1) {
+                    break;
+                }
+                if (!_sllq_cas(&(queue->head.index), &pos, pos + 1)) {
+                    continue;
+                }
+
+                callback(queue->msg ? _sllq_msg_slot(queue, pos) : cell->data);
+                _sllq_store_release(&(cell->seq), pos + queue->size);
+                _sllq_wake(&(queue->push_wait), 1);
+                pos++;
+            }
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_STEAL) {
+        if (queue->ring) {
+            size_t head = _sllq_load_acquire(&(queue->head.index));
+            size_t tail = queue->tail.index;
+
+            for (; head != tail; head++) {
+                callback(queue->ring[head & queue->mask]);
+                _sllq_store_release(&(queue->head.index), head + 1);
+            }
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_SHM) {
+        sllq_shm_t* shm = queue->shm;
+
+        if (shm) {
+            size_t head = shm->head.index;
+            size_t tail = _sllq_load_acquire(&(shm->tail.index));
+
+            for (; head != tail; head++) {
+                callback(queue->elem_size ? _sllq_msg_slot(queue, head) : *(void**)_sllq_msg_slot(queue, head));
+                _sllq_store_release(&(shm->head.index), head + 1);
+            }
+            shm->head.cache = tail;
+            _sllq_wake(&(shm->push_wait), 1);
+        }
+
+        return SLLQ_OK;
+    }
+
+    return SLLQ_EINVAL;
+}
+
+/*
+ * Queue write
+ */
+
+/*
+ * With elem_size set data points to the message to copy in
+ */
+
+static int _sllq_push(sllq_t* queue, void* data, const struct timespec* timespec)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(data);
+    if (!data) {
+        return SLLQ_EINVAL;
+    }
+    if (_sllq_closed(queue->shm ? &(queue->shm->push_wait) : &(queue->push_wait))) {
+        return SLLQ_CLOSED;
+    }
+
+    if (queue->mode == SLLQ_MUTEX) {
+        int          err, ret = SLLQ_FULL;
+        sllq_item_t* item;
+
+        sllq_assert(queue->item);
+        if (!queue->item) {
+            return SLLQ_EINVAL;
+        }
+
+        item = &(queue->item[queue->write]);
+
+        /* The other side only holds the slot briefly, block on it if waiting */
+        if ((err = timespec ? pthread_mutex_lock(&(item->mutex)) : pthread_mutex_trylock(&(item->mutex)))) {
+            if (err == EBUSY)
+                return SLLQ_EAGAIN;
+            errno = err;
+            return SLLQ_ERRNO;
+        }
+
+        if (timespec) {
+            while (item->have_data) {
+                if (_sllq_closed(&(queue->push_wait))) {
+                    pthread_mutex_unlock(&(item->mutex));
+                    return SLLQ_CLOSED;
+                }
+                if (item->want_write) {
+                    pthread_mutex_unlock(&(item->mutex));
+                    return SLLQ_EINVAL;
+                }
+                if (item->want_read) {
+                    if ((err = pthread_cond_signal(&(item->cond)))) {
+                        pthread_mutex_unlock(&(item->mutex));
+                        errno = err;
+                        return SLLQ_ERRNO;
+                    }
+                    _sllq_stat_wakeup(&(queue->shift_wait));
+                }
+
+                item->want_write = 1;
+                err              = _sllq_cond_timedwait(&(item->cond), &(item->mutex), timespec);
+                item->want_write = 0;
+
+                if (err) {
+                    pthread_mutex_unlock(&(item->mutex));
+                    if (err == ETIMEDOUT) {
+                        return SLLQ_ETIMEDOUT;
+                    }
+                    errno = err;
+                    return SLLQ_ERRNO;
+                }
+            }
+        }
+
+        if (!item->have_data) {
+            if (queue->msg) {
+                memcpy(_sllq_msg_slot(queue, queue->write), data, queue->elem_size);
+            } else {
+                item->data = data;
+            }
+            item->have_data = 1;
+            _sllq_latency_stamp(queue, queue->write, 1);
+
+            queue->write++;
+            queue->write &= queue->mask;
+
+            if (item->want_read) {
+                /* TODO: How to handle errors? We did a successful push */
+                pthread_cond_signal(&(item->cond));
+                _sllq_stat_wakeup(&(queue->shift_wait));
+            }
+            ret = SLLQ_OK;
+        }
+
+        if ((err = pthread_mutex_unlock(&(item->mutex)))) {
+            errno = err;
+            return SLLQ_ERRNO;
+        }
+
+        return ret;
+    } else if (queue->mode == SLLQ_PIPE) {
+        void*   buf = queue->elem_size ? data : (void*)&data;
+        size_t  len = queue->elem_size ? queue->elem_size : sizeof(data);
+        ssize_t n;
+
+        if (queue->write_pipe < 0) {
+            return SLLQ_EINVAL;
+        }
+
+        if (queue->pipe_wbuf) {
+            int err;
+
+            if (queue->pipe_wlen + len > _sllq_pipe_cap(queue)
+                && (err = _sllq_pipe_write_out(queue, timespec))) {
+                return err;
+            }
+            if (!queue->pipe_wlen && clock_gettime(CLOCK_MONOTONIC, &(queue->pipe_since))) {
+                return SLLQ_ERRNO;
+            }
+            memcpy(queue->pipe_wbuf + queue->pipe_wlen, buf, len);
+            queue->pipe_wlen += len;
+
+            /*
+             * The item is queued, if the pipe is full the next push retries,
+             * a failed write() wrote nothing so the item is taken back out
+             */
+            if (queue->pipe_wlen + len > _sllq_pipe_cap(queue) || _sllq_pipe_expired(queue)) {
+                if ((err = _sllq_pipe_write_out(queue, 0)) && err != SLLQ_EAGAIN) {
+                    queue->pipe_wlen -= len;
+                    return err;
+                }
+            }
+
+            return SLLQ_OK;
+        }
+
+        while ((n = write(queue->write_pipe, buf, len)) < 0) {
+            int err;
+
+            switch (errno) {
+            case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+                break;
+
+            default:
+                return SLLQ_ERRNO;
+            }
+
+            if (_sllq_closed(&(queue->push_wait))) {
+                return SLLQ_CLOSED;
+            }
+            if (!timespec) {
+                return SLLQ_EAGAIN;
+            }
+            if ((err = _sllq_poll(queue->write_pipe, POLLOUT, queue->close_pipe[0], timespec))) {
+                return err;
+            }
+        }
+        if ((size_t)n != len) {
+            close(queue->write_pipe);
+            queue->write_pipe = -1;
+            return SLLQ_ERROR;
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_ATOMIC || queue->mode == SLLQ_EVENTFD) {
+        size_t       tail;
+        unsigned int seq;
+        int          err;
+
+        sllq_assert(queue->ring);
+        if (!queue->ring) {
+            return SLLQ_EINVAL;
+        }
+
+        tail = queue->tail.index;
+        while (tail - queue->tail.cache >= queue->size) {
+            queue->tail.cache = _sllq_load_acquire(&(queue->head.index));
+            if (tail - queue->tail.cache < queue->size) {
+                break;
+            }
+
+            if (!timespec) {
+                return SLLQ_FULL;
+            }
+            seq               = _sllq_wait_prepare(&(queue->push_wait));
+            queue->tail.cache = _sllq_load_acquire(&(queue->head.index));
+            if (tail - queue->tail.cache < queue->size) {
+                _sllq_wait_cancel(&(queue->push_wait));
+                break;
+            }
+            if ((err = _sllq_wait(&(queue->push_wait), seq, timespec))) {
+                return err;
+            }
+        }
+
+        if (queue->msg) {
+            memcpy(_sllq_msg_slot(queue, tail), data, queue->elem_size);
+        } else {
+            queue->ring[tail & queue->mask] = data;
+        }
+        _sllq_latency_stamp(queue, tail, 1);
+        _sllq_store_release(&(queue->tail.index), tail + 1);
+        if (queue->mode == SLLQ_EVENTFD) {
+            _sllq_notify(queue);
+        } else {
+            _sllq_wake(&(queue->shift_wait), 1);
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_MPMC) {
+        sllq_cell_t* cell;
+        size_t       pos;
+        ssize_t      diff;
+        unsigned int seq;
+        int          err;
+
+        sllq_assert(queue->cell);
+        if (!queue->cell) {
+            return SLLQ_EINVAL;
+        }
+
+        pos = _sllq_load(&(queue->tail.index));
+        for (;;) {
+            cell = &(queue->cell[pos & queue->mask]);
+            diff = (ssize_t)(_sllq_load_acquire(&(cell->seq)) - pos);
+
+            if (!diff) {
+                if (_sllq_cas(&(queue->tail.index), &pos, pos + 1)) {
+                    break;
+                }
+                continue;
+            }
+            if (diff < 0) {
+                if (!timespec) {
+                    return SLLQ_FULL;
+                }
+                seq = _sllq_wait_prepare(&(queue->push_wait));
+                if ((ssize_t)(_sllq_load_acquire(&(cell->seq)) - pos) < 0) {
+                    if ((err = _sllq_wait(&(queue->push_wait), seq, timespec))) {
+                        return err;
+                    }
+                } else {
+                    _sllq_wait_cancel(&(queue->push_wait));
+                }
+            }
+            pos = _sllq_load(&(queue->tail.index));
+        }
+
+        if (queue->msg) {
+            memcpy(_sllq_msg_slot(queue, pos), data, queue->elem_size);
+        } else {
+            cell->data = data;
+        }
+        _sllq_latency_stamp(queue, pos, 1);
+        _sllq_store_release(&(cell->seq), pos + 1);
+        _sllq_wake(&(queue->shift_wait), 1);
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_STEAL) {
+        size_t bottom;
+
+        sllq_assert(queue->ring);
+        if (!queue->ring) {
+            return SLLQ_EINVAL;
+        }
+
+        /*
+         * Owner end of a Chase-Lev deque, tail is the bottom and head the
+         * top where thieves take from. Nothing but the owner adds work so
+         * this mode never waits.
+         */
+        bottom = queue->tail.index;
+        if (bottom - _sllq_load_acquire(&(queue->head.index)) >= queue->size) {
+            return SLLQ_FULL;
+        }
+
+        _sllq_store(&(queue->ring[bottom & queue->mask]), data);
+        _sllq_latency_stamp(queue, bottom, 1);
+        _sllq_store_release(&(queue->tail.index), bottom + 1);
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_SHM) {
+        sllq_shm_t*  shm = queue->shm;
+        size_t       tail;
+        unsigned int seq;
+        int          err;
+
+        sllq_assert(shm);
+        if (!shm) {
+            return SLLQ_EINVAL;
+        }
+
+        /* Same as ATOMIC mode but on the indexes in the shared mapping */
+        tail = shm->tail.index;
+        while (tail - shm->tail.cache >= queue->size) {
+            shm->tail.cache = _sllq_load_acquire(&(shm->head.index));
+            if (tail - shm->tail.cache < queue->size) {
+                break;
+            }
+
+            if (!timespec) {
+                return SLLQ_FULL;
+            }
+            seq             = _sllq_wait_prepare(&(shm->push_wait));
+            shm->tail.cache = _sllq_load_acquire(&(shm->head.index));
+            if (tail - shm->tail.cache < queue->size) {
+                _sllq_wait_cancel(&(shm->push_wait));
+                break;
+            }
+            if ((err = _sllq_wait(&(shm->push_wait), seq, timespec))) {
+                return err;
+            }
+        }
+
+        if (queue->elem_size) {
+            memcpy(_sllq_msg_slot(queue, tail), data, queue->elem_size);
+        } else {
+            *(void**)_sllq_msg_slot(queue, tail) = data;
+        }
+        _sllq_store_release(&(shm->tail.index), tail + 1);
+        _sllq_wake(&(shm->shift_wait), 1);
+
+        return SLLQ_OK;
+    }
+
+    return SLLQ_EINVAL;
+}
+
+/*
+ * Queue read
+ */
+
+/*
+ * data is a void** or, with elem_size set, the buffer to copy the message to
+ */
+
+static int _sllq_shift(sllq_t* queue, void* data, const struct timespec* timespec)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(data);
+    if (!data) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->mode == SLLQ_MUTEX) {
+        int             err, ret = SLLQ_EMPTY;
+        sllq_segment_t* seg;
+        sllq_item_t*    item;
+
+        sllq_assert(queue->item);
+        if (!queue->item) {
+            return SLLQ_EINVAL;
+        }
+
+        /* read is set to 0 by sllq_resize() so it is in range of either */
+        seg  = _sllq_load_acquire(&(queue->write_seg));
+        item = &(seg->item[_sllq_load(&(queue->read))]);
+
+        if ((err = timespec ? pthread_mutex_lock(&(item->mutex)) : pthread_mutex_trylock(&(item->mutex)))) {
+            if (err == EBUSY)
+                return SLLQ_EAGAIN;
+            errno = err;
+            return SLLQ_ERRNO;
+        }
+
+        /* Resized before we got the slot or while waiting, start over */
+        if (_sllq_load(&(queue->write_seg)) != seg) {
+            pthread_mutex_unlock(&(item->mutex));
+            return _sllq_shift(queue, data, timespec);
+        }
+        if (seg->next) {
+            _sllq_items_retire(queue, seg);
+        }
+
+        if (timespec) {
+            while (!item->have_data) {
+                if (_sllq_load(&(queue->write_seg)) != seg) {
+                    pthread_mutex_unlock(&(item->mutex));
+                    return _sllq_shift(queue, data, timespec);
+                }
+                if (_sllq_closed(&(queue->shift_wait))) {
+                    pthread_mutex_unlock(&(item->mutex));
+                    return SLLQ_CLOSED;
+                }
+                if (item->want_read) {
+                    pthread_mutex_unlock(&(item->mutex));
+                    return SLLQ_EINVAL;
+                }
+                if (item->want_write) {
+                    if ((err = pthread_cond_signal(&(item->cond)))) {
+                        pthread_mutex_unlock(&(item->mutex));
+                        errno = err;
+                        return SLLQ_ERRNO;
+                    }
+                    _sllq_stat_wakeup(&(queue->push_wait));
+                }
+
+                item->want_read = 1;
+                err             = _sllq_cond_timedwait(&(item->cond), &(item->mutex), timespec);
+                item->want_read = 0;
+
+                if (err) {
+                    pthread_mutex_unlock(&(item->mutex));
+                    if (err == ETIMEDOUT) {
+                        return SLLQ_ETIMEDOUT;
+                    }
+                    errno = err;
+                    return SLLQ_ERRNO;
+                }
+            }
+        }
+
+        if (item->have_data) {
+            if (queue->msg) {
+                memcpy(data, _sllq_msg_slot(queue, queue->read), queue->elem_size);
+            } else {
+                *(void**)data = item->data;
+            }
+            item->data      = 0;
+            item->have_data = 0;
+            _sllq_latency_record(queue, queue->read, 1);
+
+            queue->read++;
+            queue->read &= seg->mask;
+
+            if (item->want_write) {
+                /* TODO: How to handle errors? We did a successful shift */
+                pthread_cond_signal(&(item->cond));
+                _sllq_stat_wakeup(&(queue->push_wait));
+            }
+
+            ret = SLLQ_OK;
+        } else if (_sllq_closed(&(queue->shift_wait))) {
+            ret = SLLQ_CLOSED;
+        }
+
+        if ((err = pthread_mutex_unlock(&(item->mutex)))) {
+            errno = err;
+            return SLLQ_ERRNO;
+        }
+
+        return ret;
+    } else if (queue->mode == SLLQ_PIPE) {
+        void*   _data = 0;
+        void*   out   = queue->elem_size ? data : (void*)&_data;
+        void*   buf   = out;
+        size_t  len   = queue->elem_size ? queue->elem_size : sizeof(_data);
+        size_t  want  = len;
+        ssize_t n;
+        int     closed = 0;
+
+        if (queue->read_pipe < 0) {
+            return SLLQ_EINVAL;
+        }
+
+        if (queue->pipe_rbuf) {
+            if (queue->pipe_rpos < queue->pipe_rlen) {
+                memcpy(out, queue->pipe_rbuf + queue->pipe_rpos, len);
+                queue->pipe_rpos += len;
+                if (!queue->elem_size) {
+                    *(void**)data = _data;
+                }
+                return SLLQ_OK;
+            }
+            buf  = queue->pipe_rbuf;
+            want = _sllq_pipe_cap(queue);
+        }
+
+        while ((n = read(queue->read_pipe, buf, want)) < 0) {
+            int err;
+
+            switch (errno) {
+            case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+                break;
+
+            default:
+                return SLLQ_ERRNO;
+            }
+
+            if (closed) {
+                return SLLQ_CLOSED;
+            }
+            /* Read again after seeing the close, the last writes may be in the pipe */
+            if ((closed = _sllq_closed(&(queue->shift_wait)))) {
+                continue;
+            }
+            if (!timespec) {
+                return SLLQ_EAGAIN;
+            }
+            if ((err = _sllq_poll(queue->read_pipe, POLLIN, queue->close_pipe[0], timespec))) {
+                return err;
+            }
+        }
+        if (!n || (size_t)n % len) {
+            close(queue->read_pipe);
+            queue->read_pipe = -1;
+            return SLLQ_ERROR;
+        }
+
+        if (queue->pipe_rbuf) {
+            memcpy(out, queue->pipe_rbuf, len);
+            queue->pipe_rpos = len;
+            queue->pipe_rlen = n;
+        }
+        if (!queue->elem_size) {
+            *(void**)data = _data;
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_ATOMIC || queue->mode == SLLQ_EVENTFD) {
+        size_t       head;
+        unsigned int seq;
+        int          err;
+
+        sllq_assert(queue->ring);
+        if (!queue->ring) {
+            return SLLQ_EINVAL;
+        }
+
+        head = queue->head.index;
+        while (head == queue->head.cache) {
+            queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+            if (head != queue->head.cache) {
+                break;
+            }
+
+            if (queue->mode == SLLQ_EVENTFD) {
+                if ((err = _sllq_event_wait(queue, head, timespec))) {
+                    return err;
+                }
+                break;
+            }
+            if (_sllq_closed(&(queue->shift_wait))) {
+                /* Look once more, what was pushed before the close is shifted first */
+                queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+                if (head != queue->head.cache) {
+                    break;
+                }
+                return SLLQ_CLOSED;
+            }
+            if (!timespec) {
+                return SLLQ_EMPTY;
+            }
+            seq               = _sllq_wait_prepare(&(queue->shift_wait));
+            queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+            if (head != queue->head.cache) {
+                _sllq_wait_cancel(&(queue->shift_wait));
+                break;
+            }
+            if ((err = _sllq_wait(&(queue->shift_wait), seq, timespec)) && err != SLLQ_CLOSED) {
+                return err;
+            }
+        }
+
+        if (queue->msg) {
+            memcpy(data, _sllq_msg_slot(queue, head), queue->elem_size);
+        } else {
+            *(void**)data = *_sllq_ring_slot(queue, head);
+        }
+        _sllq_latency_record(queue, head, 1);
+        _sllq_store_release(&(queue->head.index), head + 1);
+        _sllq_wake(&(queue->push_wait), 1);
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_MPMC) {
+        sllq_cell_t* cell;
+        size_t       pos;
+        ssize_t      diff;
+        unsigned int seq;
+        int          err;
+
+        sllq_assert(queue->cell);
+        if (!queue->cell) {
+            return SLLQ_EINVAL;
+        }
+
+        pos = _sllq_load(&(queue->head.index));
+        for (;;) {
+            cell = &(queue->cell[pos & queue->mask]);
+            diff = (ssize_t)(_sllq_load_acquire(&(cell->seq)) - (pos + 1));
+
+            if (!diff) {
+                if (_sllq_cas(&(queue->head.index), &pos, pos + 1)) {
+                    break;
+                }
+                continue;
+            }
+            if (diff < 0) {
+                /* Closed and drained once no push holds a slot past pos */
+                if (_sllq_closed(&(queue->shift_wait))) {
+                    if (_sllq_load(&(queue->tail.index)) == pos) {
+                        return SLLQ_CLOSED;
+                    }
+                    pos = _sllq_load(&(queue->head.index));
+                    continue;
+                }
+                if (!timespec) {
+                    return SLLQ_EMPTY;
+                }
+                seq = _sllq_wait_prepare(&(queue->shift_wait));
+                if ((ssize_t)(_sllq_load_acquire(&(cell->seq)) - (pos + 1)) < 0) {
+                    if ((err = _sllq_wait(&(queue->shift_wait), seq, timespec)) && err != SLLQ_CLOSED) {
+                        return err;
+                    }
+                } else {
+                    _sllq_wait_cancel(&(queue->shift_wait));
+                }
+            }
+            pos = _sllq_load(&(queue->head.index));
+        }
+
+        if (queue->msg) {
+            memcpy(data, _sllq_msg_slot(queue, pos), queue->elem_size);
+        } else {
+            *(void**)data = cell->data;
+        }
+        _sllq_latency_record(queue, pos, 1);
+        _sllq_store_release(&(cell->seq), pos + queue->size);
+        _sllq_wake(&(queue->push_wait), 1);
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_STEAL) {
+        size_t bottom, top;
+        int    ret = SLLQ_OK;
+
+        sllq_assert(queue->ring);
+        if (!queue->ring) {
+            return SLLQ_EINVAL;
+        }
+
+        bottom = queue->tail.index - 1;
+        _sllq_store(&(queue->tail.index), bottom);
+        _sllq_fence();
+        top = _sllq_load(&(queue->head.index));
+
+        if ((ssize_t)(bottom - top) < 0) {
+            _sllq_store(&(queue->tail.index), bottom + 1);
+            return _sllq_closed(&(queue->shift_wait)) ? SLLQ_CLOSED : SLLQ_EMPTY;
+        }
+
+        *(void**)data = _sllq_load(&(queue->ring[bottom & queue->mask]));
+        if (bottom == top) {
+            /* Last item, race the thieves for it */
+            if (!_sllq_cas_seq_cst(&(queue->head.index), &top, top + 1)) {
+                ret = _sllq_closed(&(queue->shift_wait)) ? SLLQ_CLOSED : SLLQ_EMPTY;
+            }
+            _sllq_store(&(queue->tail.index), bottom + 1);
+        }
+        if (ret == SLLQ_OK) {
+            _sllq_latency_record(queue, bottom, 1);
+        }
+
+        return ret;
+    } else if (queue->mode == SLLQ_SHM) {
+        sllq_shm_t*  shm = queue->shm;
+        size_t       head;
+        unsigned int seq;
+        int          err;
+
+        sllq_assert(shm);
+        if (!shm) {
+            return SLLQ_EINVAL;
+        }
+
+        head = shm->head.index;
+        while (head == shm->head.cache) {
+            shm->head.cache = _sllq_load_acquire(&(shm->tail.index));
+            if (head != shm->head.cache) {
+                break;
+            }
+
+            if (_sllq_closed(&(shm->shift_wait))) {
+                /* Look once more, what was pushed before the close is shifted first */
+                shm->head.cache = _sllq_load_acquire(&(shm->tail.index));
+                if (head != shm->head.cache) {
+                    break;
+                }
+                return SLLQ_CLOSED;
+            }
+            if (!timespec) {
+                return SLLQ_EMPTY;
+            }
+            seq             = _sllq_wait_prepare(&(shm->shift_wait));
+            shm->head.cache = _sllq_load_acquire(&(shm->tail.index));
+            if (head != shm->head.cache) {
+                _sllq_wait_cancel(&(shm->shift_wait));
+                break;
+            }
+            if ((err = _sllq_wait(&(shm->shift_wait), seq, timespec)) && err != SLLQ_CLOSED) {
+                return err;
+            }
+        }
+
+        if (queue->elem_size) {
+            memcpy(data, _sllq_msg_slot(queue, head), queue->elem_size);
+        } else {
+            *(void**)data = *(void**)_sllq_msg_slot(queue, head);
+        }
+        _sllq_store_release(&(shm->head.index), head + 1);
+        _sllq_wake(&(shm->push_wait), 1);
+
+        return SLLQ_OK;
+    }
+
+    return SLLQ_EINVAL;
+}
+
+/*
+ * Queue batch write
+ */
+
+static int _sllq_push_many(sllq_t* queue, void** items, size_t n, size_t* done, const struct timespec* timespec)
+{
+    sllq_assert(done);
+    if (!done) {
+        return SLLQ_EINVAL;
+    }
+    *done = 0;
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(items);
+    if (!items) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(n);
+    if (!n) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->elem_size) {
+        return SLLQ_EINVAL;
+    }
+    if (_sllq_closed(queue->shm ? &(queue->shm->push_wait) : &(queue->push_wait))) {
+        return SLLQ_CLOSED;
+    }
+
+    if (queue->mode == SLLQ_MUTEX) {
+        int err;
+
+        /* Every slot has its own mutex so there is nothing to amortize */
+        if ((err = _sllq_push(queue, items[0], timespec))) {
+            return err;
+        }
+        for (*done = 1; *done < n; (*done)++) {
+            if (_sllq_push(queue, items[*done], 0)) {
+                break;
+            }
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_PIPE) {
+        ssize_t w;
+        size_t  k = n;
+        int     err;
+
+        if (queue->write_pipe < 0) {
+            return SLLQ_EINVAL;
+        }
+
+        /* Anything coalesced goes first to keep the order */
+        if ((err = _sllq_pipe_write_out(queue, timespec))) {
+            return err;
+        }
+
+        if (k > _SLLQ_PIPE_BATCH) {
+            k = _SLLQ_PIPE_BATCH;
+        }
+
+        /*
+         * Writes up to PIPE_BUF are atomic, so on a full pipe nothing was
+         * written and we retry with a smaller batch
+         */
+        while ((w = write(queue->write_pipe, (void*)items, k * sizeof(void*))) < 0) {
+            switch (errno) {
+            case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+                break;
+
+            default:
+                return SLLQ_ERRNO;
+            }
+
+            if (k > 1) {
+                k /= 2;
+                continue;
+            }
+            if (_sllq_closed(&(queue->push_wait))) {
+                return SLLQ_CLOSED;
+            }
+            if (!timespec) {
+                return SLLQ_EAGAIN;
+            }
+            if ((err = _sllq_poll(queue->write_pipe, POLLOUT, queue->close_pipe[0], timespec))) {
+                return err;
+            }
+        }
+        if ((size_t)w != k * sizeof(void*)) {
+            close(queue->write_pipe);
+            queue->write_pipe = -1;
+            return SLLQ_ERROR;
+        }
+
+        *done = k;
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_ATOMIC || queue->mode == SLLQ_EVENTFD) {
+        size_t       tail, room, k;
+        unsigned int seq;
+        int          err;
+
+        sllq_assert(queue->ring);
+        if (!queue->ring) {
+            return SLLQ_EINVAL;
+        }
+
+        tail = queue->tail.index;
+        room = _sllq_room(queue, tail);
+        if (room < n) {
+            queue->tail.cache = _sllq_load_acquire(&(queue->head.index));
+            while (!(room = _sllq_room(queue, tail))) {
+                if (!timespec) {
+                    return SLLQ_FULL;
+                }
+                seq               = _sllq_wait_prepare(&(queue->push_wait));
+                queue->tail.cache = _sllq_load_acquire(&(queue->head.index));
+                if (tail - queue->tail.cache < queue->size) {
+                    _sllq_wait_cancel(&(queue->push_wait));
+                    continue;
+                }
+                if ((err = _sllq_wait(&(queue->push_wait), seq, timespec))) {
+                    return err;
+                }
+                queue->tail.cache = _sllq_load_acquire(&(queue->head.index));
+            }
+            if (room > n) {
+                room = n;
+            }
+        } else {
+            room = n;
+        }
+
+        for (k = 0; k < room; k++) {
+            queue->ring[(tail + k) & queue->mask] = items[k];
+        }
+        _sllq_latency_stamp(queue, tail, room);
+        _sllq_store_release(&(queue->tail.index), tail + room);
+        if (queue->mode == SLLQ_EVENTFD) {
+            _sllq_notify(queue);
+        } else {
+            _sllq_wake(&(queue->shift_wait), 1);
+        }
+
+        *done = room;
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_MPMC) {
+        sllq_cell_t* cell;
+        size_t       pos, k;
+        ssize_t      diff;
+        unsigned int seq;
+        int          err;
+
+        sllq_assert(queue->cell);
+        if (!queue->cell) {
+            return SLLQ_EINVAL;
+        }
+
+        pos = _sllq_load(&(queue->tail.index));
+        for (;;) {
+            for (k = 0; k < n; k++) {
+                if (_sllq_load_acquire(&(queue->cell[(pos + k) & queue->mask].seq)) != pos + k) {
+                    break;
+                }
+            }
+
+            if (k) {
+                if (_sllq_cas(&(queue->tail.index), &pos, pos + k)) {
+                    break;
+                }
+                continue;
+            }
+
+            diff = (ssize_t)(_sllq_load_acquire(&(queue->cell[pos & queue->mask].seq)) - pos);
+            if (diff < 0) {
+                if (!timespec) {
+                    return SLLQ_FULL;
+                }
+                seq = _sllq_wait_prepare(&(queue->push_wait));
+                if ((ssize_t)(_sllq_load_acquire(&(queue->cell[pos & queue->mask].seq)) - pos) < 0) {
+                    if ((err = _sllq_wait(&(queue->push_wait), seq, timespec))) {
+                        return err;
+                    }
+                } else {
+                    _sllq_wait_cancel(&(queue->push_wait));
+                }
+            }
+            pos = _sllq_load(&(queue->tail.index));
+        }
+
+        _sllq_latency_stamp(queue, pos, k);
+        for (*done = 0; *done < k; (*done)++) {
+            cell       = &(queue->cell[(pos + *done) & queue->mask]);
+            cell->data = items[*done];
+            _sllq_store_release(&(cell->seq), pos + *done + 1);
+        }
+        _sllq_wake(&(queue->shift_wait), k);
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_STEAL) {
+        int err;
+
+        if ((err = _sllq_push(queue, items[0], 0))) {
+            return err;
+        }
+        for (*done = 1; *done < n; (*done)++) {
+            if (_sllq_push(queue, items[*done], 0)) {
+                break;
+            }
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_SHM) {
+        int err;
+
+        if ((err = _sllq_push(queue, items[0], timespec))) {
+            return err;
+        }
+        for (*done = 1; *done < n; (*done)++) {
+            if (_sllq_push(queue, items[*done], 0)) {
+                break;
+            }
+        }
+
+        return SLLQ_OK;
+    }
+
+    return SLLQ_EINVAL;
+}
+
+/*
+ * Queue batch read
+ */
+
+static int _sllq_shift_many(sllq_t* queue, void** out, size_t max, size_t* got, const struct timespec* timespec)
+{
+    sllq_assert(got);
+    if (!got) {
+        return SLLQ_EINVAL;
+    }
+    *got = 0;
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(out);
+    if (!out) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(max);
+    if (!max) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->elem_size) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->mode == SLLQ_MUTEX) {
+        int err;
+
+        /* Every slot has its own mutex so there is nothing to amortize */
+        if ((err = _sllq_shift(queue, &(out[0]), timespec))) {
+            return err;
+        }
+        for (*got = 1; *got < max; (*got)++) {
+            if (_sllq_shift(queue, &(out[*got]), 0)) {
+                break;
+            }
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_PIPE) {
+        ssize_t r;
+        size_t  k = max;
+        int     err, closed = 0;
+
+        if (queue->read_pipe < 0) {
+            return SLLQ_EINVAL;
+        }
+
+        if (queue->pipe_rpos < queue->pipe_rlen) {
+            if (k > (queue->pipe_rlen - queue->pipe_rpos) / sizeof(void*)) {
+                k = (queue->pipe_rlen - queue->pipe_rpos) / sizeof(void*);
+            }
+            memcpy(out, queue->pipe_rbuf + queue->pipe_rpos, k * sizeof(void*));
+            queue->pipe_rpos += k * sizeof(void*);
+            *got = k;
+
+            return SLLQ_OK;
+        }
+
+        if (k > _SLLQ_PIPE_BATCH) {
+            k = _SLLQ_PIPE_BATCH;
+        }
+
+        while ((r = read(queue->read_pipe, (void*)out, k * sizeof(void*))) < 0) {
+            switch (errno) {
+            case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+                break;
+
+            default:
+                return SLLQ_ERRNO;
+            }
+
+            if (closed) {
+                return SLLQ_CLOSED;
+            }
+            /* Read again after seeing the close, the last writes may be in the pipe */
+            if ((closed = _sllq_closed(&(queue->shift_wait)))) {
+                continue;
+            }
+            if (!timespec) {
+                return SLLQ_EAGAIN;
+            }
+            if ((err = _sllq_poll(queue->read_pipe, POLLIN, queue->close_pipe[0], timespec))) {
+                return err;
+            }
+        }
+        if (!r || r % sizeof(void*)) {
+            close(queue->read_pipe);
+            queue->read_pipe = -1;
+            return SLLQ_ERROR;
+        }
+
+        *got = r / sizeof(void*);
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_ATOMIC || queue->mode == SLLQ_EVENTFD) {
+        size_t       head, avail, k;
+        unsigned int seq;
+        int          err;
+
+        sllq_assert(queue->ring);
+        if (!queue->ring) {
+            return SLLQ_EINVAL;
+        }
+
+        head  = queue->head.index;
+        avail = queue->head.cache - head;
+        if (avail < max) {
+            queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+            while (!(avail = queue->head.cache - head)) {
+                if (queue->mode == SLLQ_EVENTFD) {
+                    if ((err = _sllq_event_wait(queue, head, timespec))) {
+                        return err;
+                    }
+                    continue;
+                }
+                if (_sllq_closed(&(queue->shift_wait))) {
+                    queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+                    if (head != queue->head.cache) {
+                        continue;
+                    }
+                    return SLLQ_CLOSED;
+                }
+                if (!timespec) {
+                    return SLLQ_EMPTY;
+                }
+                seq               = _sllq_wait_prepare(&(queue->shift_wait));
+                queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+                if (head != queue->head.cache) {
+                    _sllq_wait_cancel(&(queue->shift_wait));
+                    continue;
+                }
+                if ((err = _sllq_wait(&(queue->shift_wait), seq, timespec)) && err != SLLQ_CLOSED) {
+                    return err;
+                }
+                queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+            }
+            if (avail > max) {
+                avail = max;
+            }
+        } else {
+            avail = max;
+        }
+
+        for (k = 0; k < avail; k++) {
+            out[k] = *_sllq_ring_slot(queue, head + k);
+        }
+        _sllq_latency_record(queue, head, avail);
+        _sllq_store_release(&(queue->head.index), head + avail);
+        _sllq_wake(&(queue->push_wait), 1);
+
+        *got = avail;
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_MPMC) {
+        sllq_cell_t* cell;
+        size_t       pos, k;
+        ssize_t      diff;
+        unsigned int seq;
+        int          err;
+
+        sllq_assert(queue->cell);
+        if (!queue->cell) {
+            return SLLQ_EINVAL;
+        }
+
+        pos = _sllq_load(&(queue->head.index));
+        for (;;) {
+            for (k = 0; k < max; k++) {
+                if (_sllq_load_acquire(&(queue->cell[(pos + k) & queue->mask].seq)) != pos + k + 1) {
+                    break;
+                }
+            }
+
+            if (k) {
+                if (_sllq_cas(&(queue->head.index), &pos, pos + k)) {
+                    break;
+                }
+                continue;
+            }
+
+            diff = (ssize_t)(_sllq_load_acquire(&(queue->cell[pos & queue->mask].seq)) - (pos + 1));
+            if (diff < 0) {
+                if (_sllq_closed(&(queue->shift_wait))) {
+                    if (_sllq_load(&(queue->tail.index)) == pos) {
+                        return SLLQ_CLOSED;
+                    }
+                    pos = _sllq_load(&(queue->head.index));
+                    continue;
+                }
+                if (!timespec) {
+                    return SLLQ_EMPTY;
+                }
+                seq = _sllq_wait_prepare(&(queue->shift_wait));
+                if ((ssize_t)(_sllq_load_acquire(&(queue->cell[pos & queue->mask].seq)) - (pos + 1)) < 0) {
+                    if ((err = _sllq_wait(&(queue->shift_wait), seq, timespec)) && err != SLLQ_CLOSED) {
+                        return err;
+                    }
+                } else {
+                    _sllq_wait_cancel(&(queue->shift_wait));
+                }
+            }
+            pos = _sllq_load(&(queue->head.index));
+        }
+
+        _sllq_latency_record(queue, pos, k);
+        for (*got = 0; *got < k; (*got)++) {
+            cell      = &(queue->cell[(pos + *got) & queue->mask]);
+            out[*got] = cell->data;
+            _sllq_store_release(&(cell->seq), pos + *got + queue->size);
+        }
+        _sllq_wake(&(queue->push_wait), k);
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_STEAL) {
+        int err;
+
+        if ((err = _sllq_shift(queue, &(out[0]), 0))) {
+            return err;
+        }
+        for (*got = 1; *got < max; (*got)++) {
+            if (_sllq_shift(queue, &(out[*got]), 0)) {
+                break;
+            }
+        }
+
+        return SLLQ_OK;
+    } else if (queue->mode == SLLQ_SHM) {
+        int err;
+
+        if ((err = _sllq_shift(queue, &(out[0]), timespec))) {
+            return err;
+        }
+        for (*got = 1; *got < max; (*got)++) {
+            if (_sllq_shift(queue, &(out[*got]), 0)) {
+                break;
+            }
+        }
+
+        return SLLQ_OK;
+    }
+
+    return SLLQ_EINVAL;
+}
+
+/*
+ * Queue steal
+ */
+
+int sllq_steal(sllq_t* queue, void** data)
+{
+    size_t   top, bottom;
+    void*    _data;
+    uint64_t stamp = 0;
+    int      closed;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(data);
+    if (!data) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->mode != SLLQ_STEAL || queue->elem_size) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(queue->ring);
+    if (!queue->ring) {
+        return SLLQ_EINVAL;
+    }
+
+    /* Before the indexes, a push before the close is seen by them */
+    closed = _sllq_closed(&(queue->shift_wait));
+    top    = _sllq_load_acquire(&(queue->head.index));
+    _sllq_fence();
+    bottom = _sllq_load_acquire(&(queue->tail.index));
+
+    if ((ssize_t)(bottom - top) <= 0) {
+        return _sllq_count(queue, &(queue->shift_stats), closed ? SLLQ_CLOSED : SLLQ_EMPTY, 0);
+    }
+
+    _data = _sllq_load(&(queue->ring[top & queue->mask]));
+    if (queue->stamp) {
+        stamp = _sllq_load(&(queue->stamp[top & queue->mask]));
+    }
+    if (!_sllq_cas_seq_cst(&(queue->head.index), &top, top + 1)) {
+        return _sllq_count(queue, &(queue->shift_stats), SLLQ_EAGAIN, 0);
+    }
+    *data = _data;
+    if (queue->stamp) {
+        _sllq_latency_add(queue, _sllq_ticks() - stamp);
+    }
+
+    return _sllq_count(queue, &(queue->shift_stats), SLLQ_OK, 1);
+}
+
+/*
+ * Queue reserve/commit and peek/release, the slot is handed out in place
+ * and only the index advance in commit/release publishes it
+ */
+
+int sllq_reserve(sllq_t* queue, void** slot)
+{
+    size_t tail;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(slot);
+    if (!slot) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->lane || (queue->mode != SLLQ_ATOMIC && queue->mode != SLLQ_EVENTFD)) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(queue->ring);
+    if (!queue->ring) {
+        return SLLQ_EINVAL;
+    }
+    if (_sllq_closed(&(queue->push_wait))) {
+        return SLLQ_CLOSED;
+    }
+
+    tail = queue->tail.index;
+    if (tail - queue->tail.cache >= queue->size) {
+        queue->tail.cache = _sllq_load_acquire(&(queue->head.index));
+        if (tail - queue->tail.cache >= queue->size) {
+            return _sllq_count(queue, &(queue->push_stats), SLLQ_FULL, 0);
+        }
+    }
+
+    if (queue->msg) {
+        *slot = _sllq_msg_slot(queue, tail);
+    } else {
+        *slot = &(queue->ring[tail & queue->mask]);
+    }
+    queue->tail.held = 1;
+
+    return SLLQ_OK;
+}
+
+int sllq_commit(sllq_t* queue)
+{
+    size_t tail;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->lane || (queue->mode != SLLQ_ATOMIC && queue->mode != SLLQ_EVENTFD)) {
+        return SLLQ_EINVAL;
+    }
+
+    if (!queue->tail.held) {
+        return SLLQ_EINVAL;
+    }
+    queue->tail.held = 0;
+
+    tail = queue->tail.index;
+
+    _sllq_latency_stamp(queue, tail, 1);
+    _sllq_store_release(&(queue->tail.index), tail + 1);
+    if (queue->mode == SLLQ_EVENTFD) {
+        _sllq_notify(queue);
+    } else {
+        _sllq_wake(&(queue->shift_wait), 1);
+    }
+
+    return _sllq_count(queue, &(queue->push_stats), SLLQ_OK, 1);
+}
+
+int sllq_peek(sllq_t* queue, void** slot)
+{
+    size_t head;
+    int    err;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(slot);
+    if (!slot) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->lane || (queue->mode != SLLQ_ATOMIC && queue->mode != SLLQ_EVENTFD)) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(queue->ring);
+    if (!queue->ring) {
+        return SLLQ_EINVAL;
+    }
+
+    head = queue->head.index;
+    if (head == queue->head.cache) {
+        queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+        if (head == queue->head.cache) {
+            if (queue->mode == SLLQ_EVENTFD) {
+                if ((err = _sllq_event_wait(queue, head, 0))) {
+                    return _sllq_count(queue, &(queue->shift_stats), err, 0);
+                }
+            } else if (!_sllq_closed(&(queue->shift_wait))) {
+                return _sllq_count(queue, &(queue->shift_stats), SLLQ_EMPTY, 0);
+            } else {
+                queue->head.cache = _sllq_load_acquire(&(queue->tail.index));
+                if (head == queue->head.cache) {
+                    return SLLQ_CLOSED;
+                }
+            }
+        }
+    }
+
+    if (queue->msg) {
+        *slot = _sllq_msg_slot(queue, head);
+    } else {
+        *slot = _sllq_ring_slot(queue, head);
+    }
+    queue->head.held = 1;
+
+    return SLLQ_OK;
+}
+
+int sllq_release(sllq_t* queue)
+{
+    size_t head;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->lane || (queue->mode != SLLQ_ATOMIC && queue->mode != SLLQ_EVENTFD)) {
+        return SLLQ_EINVAL;
+    }
+
+    if (!queue->head.held) {
+        return SLLQ_EINVAL;
+    }
+    queue->head.held = 0;
+
+    head = queue->head.index;
+
+    _sllq_latency_record(queue, head, 1);
+    _sllq_store_release(&(queue->head.index), head + 1);
+    _sllq_wake(&(queue->push_wait), 1);
+
+    return _sllq_count(queue, &(queue->shift_stats), SLLQ_OK, 1);
+}
+
+/*
+ * Queue write/read with timeout and wait policy
+ */
+
+static int _sllq_push_timed(sllq_t* queue, void* data, const struct timespec* timeout, int flags)
+{
+    struct timespec deadline;
+    size_t          n;
+    int             err;
+
+    if ((err = _sllq_push(queue, data, 0)) != SLLQ_FULL && err != SLLQ_EAGAIN) {
+        return _sllq_count(queue, &(queue->push_stats), err, 1);
+    }
+    if (!timeout) {
+        return _sllq_count(queue, &(queue->push_stats), err, 1);
+    }
+
+    /* Before spinning, a relative timeout counts from the call */
+    if ((err = _sllq_deadline(timeout, flags, &deadline))) {
+        return err;
+    }
+
+    for (n = 0; n < queue->spin + queue->yield; n++) {
+        _sllq_backoff(queue, n);
+        if ((err = _sllq_push(queue, data, 0)) != SLLQ_FULL && err != SLLQ_EAGAIN) {
+            return _sllq_count(queue, &(queue->push_stats), err, 1);
+        }
+    }
+
+    _sllq_count_wait(queue, &(queue->push_stats));
+    err = _sllq_push(queue, data, &deadline);
+
+    return _sllq_count(queue, &(queue->push_stats), err, 1);
+}
+
+static int _sllq_shift_timed(sllq_t* queue, void* data, const struct timespec* timeout, int flags)
+{
+    struct timespec deadline;
+    size_t          n;
+    int             err;
+
+    if ((err = _sllq_shift(queue, data, 0)) != SLLQ_EMPTY && err != SLLQ_EAGAIN) {
+        return _sllq_count(queue, &(queue->shift_stats), err, 1);
+    }
+    if (!timeout) {
+        return _sllq_count(queue, &(queue->shift_stats), err, 1);
+    }
+
+    /* Before spinning, a relative timeout counts from the call */
+    if ((err = _sllq_deadline(timeout, flags, &deadline))) {
+        return err;
+    }
+
+    for (n = 0; n < queue->spin + queue->yield; n++) {
+        _sllq_backoff(queue, n);
+        if ((err = _sllq_shift(queue, data, 0)) != SLLQ_EMPTY && err != SLLQ_EAGAIN) {
+            return _sllq_count(queue, &(queue->shift_stats), err, 1);
+        }
+    }
+
+    _sllq_count_wait(queue, &(queue->shift_stats));
+    err = _sllq_shift(queue, data, &deadline);
+
+    return _sllq_count(queue, &(queue->shift_stats), err, 1);
+}
+
+/*
+ * Priority lanes, the lanes themselves are not counted, all statistics go
+ * in the queue holding them
+ */
+
+static int _sllq_lanes_push_timed(sllq_t* queue, sllq_t* lane, void* data, const struct timespec* timeout, int flags)
+{
+    struct timespec deadline;
+    size_t          n;
+    int             err;
+
+    err = _sllq_push(lane, data, 0);
+    if (timeout && (err == SLLQ_FULL || err == SLLQ_EAGAIN)) {
+        if ((err = _sllq_deadline(timeout, flags, &deadline))) {
+            return err;
+        }
+        err = SLLQ_FULL;
+    }
+    for (n = 0; timeout && (err == SLLQ_FULL || err == SLLQ_EAGAIN) && n < queue->spin + queue->yield; n++) {
+        _sllq_backoff(queue, n);
+        err = _sllq_push(lane, data, 0);
+    }
+
+    if (timeout && (err == SLLQ_FULL || err == SLLQ_EAGAIN)) {
+        _sllq_count_wait(queue, &(queue->push_stats));
+        err = _sllq_push(lane, data, &deadline);
+    }
+
+    if (err == SLLQ_OK) {
+        _sllq_wake(&(queue->shift_wait), 1);
+    }
+
+    return _sllq_count(queue, &(queue->push_stats), err, 1);
+}
+
+/* Closed only when every lane is, sllq_close() closes them before the queue */
+static int _sllq_lanes_shift(sllq_t* queue, void* data)
+{
+    size_t n;
+    int    err, ret = SLLQ_CLOSED;
+
+    for (n = queue->lanes; n--;) {
+        if ((err = _sllq_shift(&(queue->lane[n]), data, 0)) == SLLQ_EAGAIN || err == SLLQ_EMPTY) {
+            if (ret != SLLQ_EAGAIN) {
+                ret = err;
+            }
+        } else if (err != SLLQ_CLOSED) {
+            return err;
+        }
+    }
+
+    return ret;
+}
+
+static int _sllq_lanes_shift_timed(sllq_t* queue, void* data, const struct timespec* timeout, int flags)
+{
+    struct timespec deadline;
+    unsigned int    seq;
+    size_t          n;
+    int             err;
+
+    err = _sllq_lanes_shift(queue, data);
+    if (timeout && (err == SLLQ_EMPTY || err == SLLQ_EAGAIN)) {
+        if ((err = _sllq_deadline(timeout, flags, &deadline))) {
+            return err;
+        }
+        err = SLLQ_EMPTY;
+    }
+    for (n = 0; timeout && (err == SLLQ_EMPTY || err == SLLQ_EAGAIN) && n < queue->spin + queue->yield; n++) {
+        _sllq_backoff(queue, n);
+        err = _sllq_lanes_shift(queue, data);
+    }
+
+    if (timeout && (err == SLLQ_EMPTY || err == SLLQ_EAGAIN)) {
+        /* A push to any lane wakes shift_wait, look again once waiting on it */
+        _sllq_count_wait(queue, &(queue->shift_stats));
+        do {
+            seq = _sllq_wait_prepare(&(queue->shift_wait));
+            if ((err = _sllq_lanes_shift(queue, data)) != SLLQ_EMPTY && err != SLLQ_EAGAIN) {
+                _sllq_wait_cancel(&(queue->shift_wait));
+                break;
+            }
+        } while (!(err = _sllq_wait(&(queue->shift_wait), seq, &deadline)) || err == SLLQ_CLOSED);
+    }
+
+    return _sllq_count(queue, &(queue->shift_stats), err, 1);
+}
+
+int sllq_push_timed(sllq_t* queue, void* data, const struct timespec* timeout, int flags)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->elem_size) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->lane) {
+        return _sllq_lanes_push_timed(queue, &(queue->lane[0]), data, timeout, flags);
+    }
+
+    return _sllq_push_timed(queue, data, timeout, flags);
+}
+
+int sllq_shift_timed(sllq_t* queue, void** data, const struct timespec* timeout, int flags)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->elem_size) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->lane) {
+        return _sllq_lanes_shift_timed(queue, data, timeout, flags);
+    }
+
+    return _sllq_shift_timed(queue, data, timeout, flags);
+}
+
+int sllq_push_prio_timed(sllq_t* queue, void* data, size_t prio, const struct timespec* timeout, int flags)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->elem_size) {
+        return SLLQ_EINVAL;
+    }
+
+    if (!queue->lane) {
+        if (prio) {
+            return SLLQ_EINVAL;
+        }
+        return _sllq_push_timed(queue, data, timeout, flags);
+    }
+    if (prio >= queue->lanes) {
+        return SLLQ_EINVAL;
+    }
+
+    return _sllq_lanes_push_timed(queue, &(queue->lane[prio]), data, timeout, flags);
+}
+
+int sllq_push_msg_timed(sllq_t* queue, const void* msg, const struct timespec* timeout, int flags)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (!queue->elem_size) {
+        return SLLQ_EINVAL;
+    }
+
+    return _sllq_push_timed(queue, (void*)msg, timeout, flags);
+}
+
+int sllq_shift_msg_timed(sllq_t* queue, void* msg, const struct timespec* timeout, int flags)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (!queue->elem_size) {
+        return SLLQ_EINVAL;
+    }
+
+    return _sllq_shift_timed(queue, msg, timeout, flags);
+}
+
+int sllq_push_many_timed(sllq_t* queue, void** items, size_t n, size_t* done, const struct timespec* timeout, int flags)
+{
+    struct timespec deadline;
+    size_t          i;
+    int             err;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(done);
+    if (!done) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->lane) {
+        return SLLQ_EINVAL;
+    }
+
+    if ((err = _sllq_push_many(queue, items, n, done, 0)) != SLLQ_FULL && err != SLLQ_EAGAIN) {
+        return _sllq_count(queue, &(queue->push_stats), err, *done);
+    }
+    if (!timeout) {
+        return _sllq_count(queue, &(queue->push_stats), err, *done);
+    }
+
+    if ((err = _sllq_deadline(timeout, flags, &deadline))) {
+        return err;
+    }
+
+    for (i = 0; i < queue->spin + queue->yield; i++) {
+        _sllq_backoff(queue, i);
+        if ((err = _sllq_push_many(queue, items, n, done, 0)) != SLLQ_FULL && err != SLLQ_EAGAIN) {
+            return _sllq_count(queue, &(queue->push_stats), err, *done);
+        }
+    }
+
+    _sllq_count_wait(queue, &(queue->push_stats));
+    err = _sllq_push_many(queue, items, n, done, &deadline);
+
+    return _sllq_count(queue, &(queue->push_stats), err, *done);
+}
+
+int sllq_shift_many_timed(sllq_t* queue, void** out, size_t max, size_t* got, const struct timespec* timeout, int flags)
+{
+    struct timespec deadline;
+    size_t          i;
+    int             err;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(got);
+    if (!got) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->lane) {
+        return SLLQ_EINVAL;
+    }
+
+    if ((err = _sllq_shift_many(queue, out, max, got, 0)) != SLLQ_EMPTY && err != SLLQ_EAGAIN) {
+        return _sllq_count(queue, &(queue->shift_stats), err, *got);
+    }
+    if (!timeout) {
+        return _sllq_count(queue, &(queue->shift_stats), err, *got);
+    }
+
+    if ((err = _sllq_deadline(timeout, flags, &deadline))) {
+        return err;
+    }
+
+    for (i = 0; i < queue->spin + queue->yield; i++) {
+        _sllq_backoff(queue, i);
+        if ((err = _sllq_shift_many(queue, out, max, got, 0)) != SLLQ_EMPTY && err != SLLQ_EAGAIN) {
+            return _sllq_count(queue, &(queue->shift_stats), err, *got);
+        }
+    }
+
+    _sllq_count_wait(queue, &(queue->shift_stats));
+    err = _sllq_shift_many(queue, out, max, got, &deadline);
+
+    return _sllq_count(queue, &(queue->shift_stats), err, *got);
+}
+
+int sllq_push(sllq_t* queue, void* data, const struct timespec* abstime)
+{
+    return sllq_push_timed(queue, data, abstime, SLLQ_TIMEOUT_REALTIME);
+}
+
+int sllq_shift(sllq_t* queue, void** data, const struct timespec* abstime)
+{
+    return sllq_shift_timed(queue, data, abstime, SLLQ_TIMEOUT_REALTIME);
+}
+
+/* There is no deadline to give, wait a day at a time until it goes through */
+int sllq_push_wait(sllq_t* queue, void* data)
+{
+    struct timespec day = { 86400, 0 };
+    int             err;
+
+    while ((err = sllq_push_timed(queue, data, &day, SLLQ_TIMEOUT_RELATIVE)) == SLLQ_ETIMEDOUT)
+        ;
+
+    return err;
+}
+
+int sllq_shift_wait(sllq_t* queue, void** data)
+{
+    struct timespec day = { 86400, 0 };
+    int             err;
+
+    while ((err = sllq_shift_timed(queue, data, &day, SLLQ_TIMEOUT_RELATIVE)) == SLLQ_ETIMEDOUT)
+        ;
+
+    return err;
+}
+
+int sllq_push_prio(sllq_t* queue, void* data, size_t prio, const struct timespec* abstime)
+{
+    return sllq_push_prio_timed(queue, data, prio, abstime, SLLQ_TIMEOUT_REALTIME);
+}
+
+int sllq_push_many(sllq_t* queue, void** items, size_t n, size_t* done, const struct timespec* abstime)
+{
+    return sllq_push_many_timed(queue, items, n, done, abstime, SLLQ_TIMEOUT_REALTIME);
+}
+
+int sllq_shift_many(sllq_t* queue, void** out, size_t max, size_t* got, const struct timespec* abstime)
+{
+    return sllq_shift_many_timed(queue, out, max, got, abstime, SLLQ_TIMEOUT_REALTIME);
+}
+
+int sllq_push_msg(sllq_t* queue, const void* msg, const struct timespec* abstime)
+{
+    return sllq_push_msg_timed(queue, msg, abstime, SLLQ_TIMEOUT_REALTIME);
+}
+
+int sllq_shift_msg(sllq_t* queue, void* msg, const struct timespec* abstime)
+{
+    return sllq_shift_msg_timed(queue, msg, abstime, SLLQ_TIMEOUT_REALTIME);
+}
+
+int sllq_push_flush(sllq_t* queue, const struct timespec* abstime)
+{
+    struct timespec deadline;
+    int             err;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+
+    if (queue->mode != SLLQ_PIPE) {
+        return SLLQ_OK;
+    }
+    if (queue->write_pipe < 0) {
+        return SLLQ_EINVAL;
+    }
+
+    if (!abstime) {
+        return _sllq_pipe_write_out(queue, 0);
+    }
+    if ((err = _sllq_deadline(abstime, SLLQ_TIMEOUT_REALTIME, &deadline))) {
+        return err;
+    }
+
+    return _sllq_pipe_write_out(queue, &deadline);
+}
+
+/*
+ * Queue hot path, the out-of-line versions of the SLLQ_INLINE calls
+ */
+
+void sllq_inline_wake_(sllq_wait_t* wait)
+{
+    sllq_assert(wait);
+    if (wait) {
+        _sllq_wake(wait, 1);
+    }
+}
+
+int sllq_push_spsc(sllq_t* queue, void* data)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->mode != SLLQ_ATOMIC) {
+        return SLLQ_EINVAL;
+    }
+
+    return sllq_push_timed(queue, data, 0, SLLQ_TIMEOUT_RELATIVE);
+}
+
+int sllq_shift_spsc(sllq_t* queue, void** data)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->mode != SLLQ_ATOMIC) {
+        return SLLQ_EINVAL;
+    }
+
+    return sllq_shift_timed(queue, data, 0, SLLQ_TIMEOUT_RELATIVE);
+}
+
+int sllq_push_mpmc(sllq_t* queue, void* data)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->mode != SLLQ_MPMC) {
+        return SLLQ_EINVAL;
+    }
+
+    return sllq_push_timed(queue, data, 0, SLLQ_TIMEOUT_RELATIVE);
+}
+
+int sllq_shift_mpmc(sllq_t* queue, void** data)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (queue->mode != SLLQ_MPMC) {
+        return SLLQ_EINVAL;
+    }
+
+    return sllq_shift_timed(queue, data, 0, SLLQ_TIMEOUT_RELATIVE);
+}
+
+/*
+ * Queue statistics
+ */
+
+static size_t _sllq_depth(const sllq_t* queue)
+{
+    ssize_t depth = 0;
+
+    if (queue->lane) {
+        size_t n, sum = 0;
+
+        for (n = 0; n < queue->lanes; n++) {
+            sum += _sllq_depth(&(queue->lane[n]));
+        }
+        return sum;
+    }
+
+    if (queue->mode == SLLQ_MUTEX) {
+        sllq_segment_t* seg = _sllq_load_acquire(&(queue->write_seg));
+
+        if (seg) {
+            size_t read = _sllq_load(&(queue->read)) & seg->mask;
+
+            depth = (_sllq_load(&(queue->write)) - read) & seg->mask;
+            if (!depth && seg->item[read].have_data) {
+                depth = seg->mask + 1;
+            }
+        }
+    } else if (queue->mode == SLLQ_PIPE) {
+#ifdef FIONREAD
+        int bytes = 0;
+
+        if (queue->read_pipe > -1 && !ioctl(queue->read_pipe, FIONREAD, &bytes)) {
+            depth = bytes / _sllq_pipe_item(queue);
+        }
+#endif
+        depth += (_sllq_load(&(queue->pipe_rlen)) - _sllq_load(&(queue->pipe_rpos)) + _sllq_load(&(queue->pipe_wlen))) / _sllq_pipe_item(queue);
+    } else if (queue->mode == SLLQ_SHM) {
+        if (queue->shm) {
+            depth = _sllq_load(&(queue->shm->tail.index)) - _sllq_load(&(queue->shm->head.index));
+        }
+    } else {
+        depth = _sllq_load(&(queue->tail.index)) - _sllq_load(&(queue->head.index));
+    }
+
+    /* Indexes are read one at a time so this is only a snapshot */
+    if (depth < 0) {
+        return 0;
+    }
+    if ((size_t)depth > queue->size && queue->mode != SLLQ_PIPE) {
+        return queue->size;
+    }
+    return depth;
+}
+
+int sllq_get_stats(sllq_t* queue, sllq_stats_t* stats)
+{
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(stats);
+    if (!stats) {
+        return SLLQ_EINVAL;
+    }
+
+    memset(stats, 0, sizeof(sllq_stats_t));
+    stats->depth = _sllq_depth(queue);
+
+#if SLLQ_STATS
+    {
+        sllq_wait_t* push_wait  = queue->shm ? &(queue->shm->push_wait) : &(queue->push_wait);
+        sllq_wait_t* shift_wait = queue->shm ? &(queue->shm->shift_wait) : &(queue->shift_wait);
+
+        _sllq_stat_high_water(queue, stats->depth);
+
+        stats->pushes         = _sllq_load(&(queue->push_stats.ops));
+        stats->shifts         = _sllq_load(&(queue->shift_stats.ops));
+        stats->push_again     = _sllq_load(&(queue->push_stats.again));
+        stats->push_full      = _sllq_load(&(queue->push_stats.full));
+        stats->shift_again    = _sllq_load(&(queue->shift_stats.again));
+        stats->shift_empty    = _sllq_load(&(queue->shift_stats.full));
+        stats->push_waits     = _sllq_load(&(queue->push_stats.waits));
+        stats->push_timeouts  = _sllq_load(&(queue->push_stats.timeouts));
+        stats->shift_waits    = _sllq_load(&(queue->shift_stats.waits));
+        stats->shift_timeouts = _sllq_load(&(queue->shift_stats.timeouts));
+        stats->push_wakeups   = _sllq_load(&(push_wait->wakeups));
+        stats->shift_wakeups  = _sllq_load(&(shift_wait->wakeups));
+        stats->high_water     = _sllq_load(&(queue->push_stats.high_water));
+
+        /* Producers waiting in a lane are woken on its own push_wait */
+        if (queue->lane) {
+            size_t n;
+
+            for (n = 0; n < queue->lanes; n++) {
+                stats->push_wakeups += _sllq_load(&(queue->lane[n].push_wait.wakeups));
+            }
+        }
+    }
+#endif
+
+    return SLLQ_OK;
+}
+
+/*
+ * Queue latency
+ */
+
+int sllq_latency_percentile(const sllq_t* queue, double percentile, struct timespec* latency)
+{
+    size_t   n, total, target, seen;
+    uint64_t ticks;
+    double   ns;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(latency);
+    if (!latency) {
+        return SLLQ_EINVAL;
+    }
+    if (!queue->histogram || !(percentile >= 0 && percentile <= 100)) {
+        return SLLQ_EINVAL;
+    }
+
+    for (total = 0, n = 0; n < _SLLQ_LATENCY_BUCKETS; n++) {
+        total += _sllq_load(&(queue->histogram[n]));
+    }
+    if (!total) {
+        return SLLQ_EMPTY;
+    }
+
+    target = (size_t)(total * percentile / 100);
+    if ((double)target < total * percentile / 100 || !target) {
+        target++;
+    }
+    for (seen = 0, n = 0; n < _SLLQ_LATENCY_BUCKETS - 1; n++) {
+        if ((seen += _sllq_load(&(queue->histogram[n]))) >= target) {
+            break;
+        }
+    }
+    ticks = _sllq_latency_value(n);
+
+#ifdef _SLLQ_LATENCY_TICKS
+    {
+        struct timespec now;
+        uint64_t        now_ticks;
+
+        /* Calibrate against the clock since init, at least a millisecond */
+        do {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            now_ticks = _sllq_ticks();
+            ns        = (now.tv_sec - queue->latency_time.tv_sec) * 1e9 + (now.tv_nsec - queue->latency_time.tv_nsec);
+        } while (ns < 1e6);
+        ns = ticks * (ns / (now_ticks - queue->latency_ticks));
+    }
+#else
+    ns = ticks;
+#endif
+
+    latency->tv_sec  = (time_t)(ns / 1e9);
+    latency->tv_nsec = (long)(ns - latency->tv_sec * 1e9);
+
+    return SLLQ_OK;
+}
+
+int sllq_latency_reset(sllq_t* queue)
+{
+    size_t n;
+
+    sllq_assert(queue);
+    if (!queue) {
+        return SLLQ_EINVAL;
+    }
+    if (!queue->histogram) {
+        return SLLQ_EINVAL;
+    }
+
+    for (n = 0; n < _SLLQ_LATENCY_BUCKETS; n++) {
+        _sllq_store(&(queue->histogram[n]), 0);
+    }
+
+    return SLLQ_OK;
+}
+
+/*
+ * Pool
+ */
+
+static sllq_pool_t _sllq_pool_t_defaults = SLLQ_POOL_T_INIT;
+
+sllq_pool_t* sllq_pool_new(void)
+{
+    sllq_pool_t* pool = calloc(1, sizeof(sllq_pool_t));
+
+    if (pool) {
+        memcpy(pool, &_sllq_pool_t_defaults, sizeof(sllq_pool_t));
+    }
+
+    return pool;
+}
+
+void sllq_pool_free(sllq_pool_t* pool)
+{
+    if (pool) {
+        free(pool);
+    }
+}
+
+int sllq_pool_set_mode(sllq_pool_t* pool, sllq_mode_t mode)
+{
+    sllq_assert(pool);
+    if (!pool) {
+        return SLLQ_EINVAL;
+    }
+
+    /* Buffers are process local and go back from any consumer */
+    if (mode == SLLQ_SHM || mode == SLLQ_STEAL) {
+        return SLLQ_EINVAL;
+    }
+
+    return sllq_set_mode(&(pool->ring), mode);
+}
+
+inline size_t sllq_pool_size(const sllq_pool_t* pool)
+{
+    sllq_assert(pool);
+    return pool->ring.size;
+}
+
+int sllq_pool_set_size(sllq_pool_t* pool, size_t size)
+{
+    sllq_assert(pool);
+    if (!pool) {
+        return SLLQ_EINVAL;
+    }
+
+    return sllq_set_size(&(pool->ring), size);
+}
+
+inline size_t sllq_pool_buf_size(const sllq_pool_t* pool)
+{
+    sllq_assert(pool);
+    return pool->buf_size;
+}
+
+int sllq_pool_set_buf_size(sllq_pool_t* pool, size_t buf_size)
+{
+    sllq_assert(pool);
+    if (!pool) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(buf_size);
+    if (!buf_size) {
+        return SLLQ_EINVAL;
+    }
+
+    if (pool->buf) {
+        return SLLQ_EBUSY;
+    }
+
+    /* Keep buffers in cache lines of their own */
+    pool->buf_size = buf_size;
+    pool->stride   = (buf_size + SLLQ_CACHELINE - 1) & ~((size_t)SLLQ_CACHELINE - 1);
+
+    return SLLQ_OK;
+}
+
+size_t sllq_pool_exhausted(const sllq_pool_t* pool)
+{
+    sllq_assert(pool);
+    return _sllq_load(&(pool->exhausted));
+}
+
+int sllq_pool_init(sllq_pool_t* pool)
+{
+    void*  buf;
+    size_t n;
+    int    err;
+
+    sllq_assert(pool);
+    if (!pool) {
+        return SLLQ_EINVAL;
+    }
+    if (!pool->buf_size || pool->ring.elem_size) {
+        return SLLQ_EINVAL;
+    }
+    if (pool->buf) {
+        return SLLQ_EBUSY;
+    }
+
+    if ((err = sllq_init(&(pool->ring)))) {
+        return err;
+    }
+
+    if (pool->stride > ((size_t)-1) / pool->ring.size
+        || posix_memalign(&buf, SLLQ_CACHELINE, pool->ring.size * pool->stride)) {
+        sllq_destroy(&(pool->ring));
+        return SLLQ_ENOMEM;
+    }
+    pool->buf       = buf;
+    pool->exhausted = 0;
+
+    for (n = 0; n < pool->ring.size; n++) {
+        if ((err = sllq_push(&(pool->ring), pool->buf + n * pool->stride, 0))) {
+            sllq_pool_destroy(pool);
+            return err;
+        }
+    }
+    if ((err = sllq_push_flush(&(pool->ring), 0))) {
+        sllq_pool_destroy(pool);
+        return err;
+    }
+
+    return SLLQ_OK;
+}
+
+int sllq_pool_destroy(sllq_pool_t* pool)
+{
+    int err;
+
+    sllq_assert(pool);
+    if (!pool) {
+        return SLLQ_EINVAL;
+    }
+
+    if ((err = sllq_destroy(&(pool->ring)))) {
+        return err;
+    }
+    if (pool->buf) {
+        free(pool->buf);
+        pool->buf = 0;
+    }
+
+    return SLLQ_OK;
+}
+
+int sllq_pool_get(sllq_pool_t* pool, void** buf, const struct timespec* abstime)
+{
+    return sllq_pool_get_timed(pool, buf, abstime, SLLQ_TIMEOUT_REALTIME);
+}
+
+int sllq_pool_get_timed(sllq_pool_t* pool, void** buf, const struct timespec* timeout, int flags)
+{
+    int err;
+
+    sllq_assert(pool);
+    if (!pool) {
+        return SLLQ_EINVAL;
+    }
+    sllq_assert(buf);
+    if (!buf) {
+        return SLLQ_EINVAL;
+    }
+
+    /* Count running out even if a buffer comes back while waiting */
+    err = sllq_shift_timed(&(pool->ring), buf, 0, flags);
+    if (err == SLLQ_EAGAIN && pool->ring.mode == SLLQ_PIPE) {
+        /* An empty pipe */
+        err = SLLQ_EMPTY;
+    }
+    if (err == SLLQ_EMPTY) {
+        _sllq_stat_add(&(pool->ring), &(pool->exhausted), 1);
+    } else if (err != SLLQ_EAGAIN) {
+        return err;
+    }
+    if (!timeout) {
+        return err;
+    }
+
+    return sllq_shift_timed(&(pool->ring), buf, timeout, flags);
+}
+
+int sllq_pool_put(sllq_pool_t* pool, void* buf)
+{
+    size_t offset;
+    int    err;
+
+    sllq_assert(pool);
+    if (!pool) {
+        return SLLQ_EINVAL;
+    }
+    if (!pool->buf || (char*)buf < pool->buf) {
+        return SLLQ_EINVAL;
+    }
+    offset = (char*)buf - pool->buf;
+    if (offset >= pool->ring.size * pool->stride || offset % pool->stride) {
+        return SLLQ_EINVAL;
+    }
+
+    /*
+     * The ring has room for every buffer so full means one was put twice,
+     * only a contended slot is retried and in PIPE mode that is a full pipe
+     */
+    while ((err = sllq_push(&(pool->ring), buf, 0)) == SLLQ_EAGAIN) {
+        if (pool->ring.mode == SLLQ_PIPE) {
+            return SLLQ_FULL;
+        }
+    }
+
+    return err;
 }
 
 /*
@@ -690,6 +4480,8 @@ const char* sllq_strerror(int errnum)
         return SLLQ_EMPTY_STR;
     case SLLQ_FULL:
         return SLLQ_FULL_STR;
+    case SLLQ_CLOSED:
+        return SLLQ_CLOSED_STR;
     }
     return "UNKNOWN";
 }
@@ -23,7 +23,9 @@
 #define __sllq_h
 
 #include <pthread.h>
+#include <stdint.h>
 #include <signal.h>
+#include <sys/types.h>
 #if SLLQ_ENABLE_ASSERT
 #include <assert.h>
 #define sllq_assert(x) assert(x)
@@ -48,6 +50,7 @@
 #define SLLQ_EAGAIN         7
 #define SLLQ_EMPTY          8
 #define SLLQ_FULL           9
+#define SLLQ_CLOSED         10
 
 #define SLLQ_ERROR_STR      "generic error"
 #define SLLQ_ERRNO_STR      "system error"
@@ -58,6 +61,13 @@
 #define SLLQ_EAGAIN_STR     "try again"
 #define SLLQ_EMPTY_STR      "queue is empty"
 #define SLLQ_FULL_STR       "queue is full"
+#define SLLQ_CLOSED_STR     "queue is closed"
+
+#define SLLQ_CACHELINE      64
+
+#define SLLQ_TIMEOUT_RELATIVE   0
+#define SLLQ_TIMEOUT_MONOTONIC  1
+#define SLLQ_TIMEOUT_REALTIME   2
 
 /* clang-format on */
 
@@ -89,17 +99,145 @@ struct sllq_item {
     pthread_cond_t  cond;
 };
 
-typedef enum sllq_mode sllq_mode_t;
 enum sllq_mode {
     SLLQ_MUTEX,
-    SLLQ_PIPE
+    SLLQ_PIPE,
+    SLLQ_ATOMIC,
+    SLLQ_MPMC,
+    SLLQ_EVENTFD,
+    SLLQ_STEAL,
+    SLLQ_SHM
+};
+typedef enum sllq_mode sllq_mode_t;
+
+/* clang-format off */
+#define SLLQ_INDEX_T_INIT { \
+    0, 0, 0, \
+    { 0 } \
+}
+/* clang-format on */
+/* clang-format off */
+#define SLLQ_CELL_T_INIT { \
+    0, 0 \
+}
+/* clang-format on */
+typedef struct sllq_cell sllq_cell_t;
+struct sllq_cell {
+    size_t seq;
+    void*  data;
+};
+
+typedef struct sllq_segment sllq_segment_t;
+struct sllq_segment {
+    void**          ring;
+    sllq_item_t*    item;
+    size_t          mask;
+    size_t          end;
+    sllq_segment_t* next;
+};
+
+typedef struct sllq_index sllq_index_t;
+/* held is set by sllq_reserve()/sllq_peek() until sllq_commit()/sllq_release() */
+struct sllq_index {
+    size_t index;
+    size_t cache;
+    int    held;
+
+    char pad[SLLQ_CACHELINE];
+};
+
+/* clang-format off */
+#define SLLQ_WAIT_T_INIT { \
+    0, 0, 0, 0, 0, \
+    { 0 } \
+}
+/* clang-format on */
+/* closed is set by sllq_close(), waiting on a closed wait returns SLLQ_CLOSED */
+typedef struct sllq_wait sllq_wait_t;
+struct sllq_wait {
+    unsigned int futex;
+    unsigned int waiters;
+    unsigned int shared;
+    unsigned int closed;
+    size_t       wakeups;
+
+    char pad[SLLQ_CACHELINE];
+};
+
+/* clang-format off */
+#define SLLQ_COUNTERS_T_INIT { \
+    0, 0, 0, 0, 0, 0, \
+    { 0 } \
+}
+/* clang-format on */
+typedef struct sllq_counters sllq_counters_t;
+struct sllq_counters {
+    size_t ops;
+    size_t again;
+    size_t full;
+    size_t waits;
+    size_t timeouts;
+    size_t high_water;
+
+    char pad[SLLQ_CACHELINE];
+};
+
+typedef struct sllq_stats sllq_stats_t;
+struct sllq_stats {
+    size_t pushes;
+    size_t shifts;
+    size_t push_again;
+    size_t push_full;
+    size_t shift_again;
+    size_t shift_empty;
+    size_t push_waits;
+    size_t push_timeouts;
+    size_t shift_waits;
+    size_t shift_timeouts;
+    size_t push_wakeups;
+    size_t shift_wakeups;
+    size_t depth;
+    size_t high_water;
+};
+
+#define SLLQ_SHM_MAGIC 0x736c6c71
+
+/*
+ * SHM mode control block at the start of the mapping, the slots follow
+ * at the next cache line
+ */
+typedef struct sllq_shm sllq_shm_t;
+struct sllq_shm {
+    unsigned int magic;
+    size_t       size;
+    size_t       elem_size;
+
+    char         pad[SLLQ_CACHELINE];
+    sllq_index_t head;
+    sllq_index_t tail;
+    sllq_wait_t  push_wait;
+    sllq_wait_t  shift_wait;
 };
 
+/* SLLQ_T_INIT_MODE() is SLLQ_T_INIT for another mode */
 /* clang-format off */
-#define SLLQ_T_INIT { \
-    SLLQ_MUTEX, \
-    0, 0, 0, 0, 0 \
-    -1, -1 \
+#define SLLQ_T_INIT SLLQ_T_INIT_MODE(SLLQ_MUTEX)
+#define SLLQ_T_INIT_MODE(mode) { \
+    mode, \
+    0, 0, 0, 0, 0, \
+    -1, -1, \
+    0, 0, 0, 0, 0, 0, 0, { 0, 0 }, { 0, 0 }, \
+    -1, \
+    0, 0, 0, 0, 0, 0, 0, { 0 }, SLLQ_INDEX_T_INIT, SLLQ_INDEX_T_INIT, \
+    SLLQ_WAIT_T_INIT, SLLQ_WAIT_T_INIT, \
+    0, 0, \
+    0, 0, 0, \
+    0, 0, -1, 0, 0, \
+    0, { 0 }, SLLQ_COUNTERS_T_INIT, SLLQ_COUNTERS_T_INIT, \
+    0, 0, 0, 0, { 0, 0 }, \
+    0, 0, \
+    -1, 0, 0, \
+    { -1, -1 } \
 }
 /* clang-format on */
 typedef struct sllq sllq_t;
@@ -113,9 +251,158 @@ struct sllq {
     size_t       read;
     size_t       write;
 
-    /* PIPE mode */
-    int read_pipe;
-    int write_pipe;
+    /*
+     * PIPE mode, with pipe_readahead set the consumer reads ahead into
+     * pipe_rbuf and serves shifts from pipe_rpos up to pipe_rlen, with
+     * pipe_coalesce set the producer collects pushes in pipe_wbuf and
+     * writes them out when it is full or when a push finds the first item,
+     * pushed at pipe_since, older than pipe_delay. Otherwise only
+     * sllq_push_flush() and sllq_close() write it out.
+     */
+    int             read_pipe;
+    int             write_pipe;
+    int             pipe_readahead;
+    char*           pipe_rbuf;
+    size_t          pipe_rpos;
+    size_t          pipe_rlen;
+    int             pipe_coalesce;
+    char*           pipe_wbuf;
+    size_t          pipe_wlen;
+    struct timespec pipe_delay;
+    struct timespec pipe_since;
+
+    /* EVENTFD mode, the ring is the same as ATOMIC mode */
+    int event_fd;
+
+    /*
+     * ATOMIC mode, head is owned by the consumer and tail by the producer,
+     * each side keeps a cached copy of the other side's index
+     *
+     * MPMC mode, head and tail are shared by all consumers and producers and
+     * each cell carries a sequence number telling which lap it is in
+     *
+     * MUTEX mode, write_seg holds the slots in item with their mask so the
+     * consumer can read both at once, sllq_resize() moves the items to new
+     * slots and keeps the old ones linked from next until destroy
+     *
+     * sllq_resize() in ATOMIC and EVENTFD modes moves the producer to a new
+     * ring at once, the segment it leaves gets the index it ended at and a
+     * link to the new one. The consumer reads read_ring until it reaches
+     * the end of read_seg and then frees it and follows the link, segment
+     * is the first segment and is set by the first resize.
+     */
+    void**          ring;
+    sllq_cell_t*    cell;
+    sllq_segment_t* segment;
+    sllq_segment_t* write_seg;
+    sllq_segment_t* read_seg;
+    void**          read_ring;
+    size_t          read_mask;
+    char            pad[SLLQ_CACHELINE];
+    sllq_index_t    head;
+    sllq_index_t    tail;
+
+    /*
+     * ATOMIC, EVENTFD and MPMC modes, producers wait on push_wait for space
+     * and consumers on shift_wait for data, a futex word each on Linux
+     *
+     * STEAL mode uses head as the top and tail as the bottom of the deque
+     *
+     * In EVENTFD mode shift_wait.waiters is set while the consumer is armed
+     * and the next push will signal event_fd
+     */
+    sllq_wait_t push_wait;
+    sllq_wait_t shift_wait;
+
+    /* Wait policy, spin and yield retries before blocking */
+    size_t spin;
+    size_t yield;
+
+    /*
+     * Inline messages, when elem_size is set each slot holds a copy of an
+     * elem_size message at msg + slot * stride instead of a pointer, PIPE
+     * mode writes the message itself into the pipe
+     */
+    size_t elem_size;
+    size_t stride;
+    char*  msg;
+
+    /*
+     * SHM mode, a single producer/single consumer ring in a shared mapping
+     * of shm_size bytes, msg points at the slots which hold the message or
+     * the pointer sized value pushed. shm_name is not copied.
+     */
+    sllq_shm_t* shm;
+    size_t      shm_size;
+    int         shm_fd;
+    int         shm_created;
+    const char* shm_name;
+
+    /*
+     * Statistics, each side counts in its own cache line and the counts
+     * of SLLQ_FULL and SLLQ_EMPTY returns both go in full. Wakeups are
+     * counted in push_wait and shift_wait by whoever wakes the waiters.
+     * stats is set by sllq_init() when the library keeps them.
+     */
+    int             stats;
+    char            stats_pad[SLLQ_CACHELINE];
+    sllq_counters_t push_stats;
+    sllq_counters_t shift_stats;
+
+    /*
+     * Latency, when set each slot is stamped with a tick count on push and
+     * shifts add the ticks spent in the queue to a log-linear histogram,
+     * latency_ticks and latency_time taken at init calibrate ticks to time
+     */
+    int             latency;
+    uint64_t*       stamp;
+    size_t*         histogram;
+    uint64_t        latency_ticks;
+    struct timespec latency_time;
+
+    /*
+     * Priority lanes, with lanes set the queue has no ring of its own but
+     * one queue per lane in lane, pushes go to the lane of their priority
+     * and shifts take from the highest non-empty lane and wait on the
+     * shift_wait of this queue
+     */
+    size_t  lanes;
+    sllq_t* lane;
+
+    /*
+     * Memory placement, with numa_node, hugepages or prefault set the
+     * slots and messages are mapped instead of allocated, bound to the
+     * node, backed by huge pages when available and faulted in at init
+     */
+    int numa_node;
+    int hugepages;
+    int prefault;
+
+    /*
+     * PIPE mode, sllq_close() writes to close_pipe to wake producers and
+     * consumers polling the pipe
+     */
+    int close_pipe[2];
+};
+
+/* clang-format off */
+#define SLLQ_POOL_T_INIT { \
+    SLLQ_T_INIT_MODE(SLLQ_ATOMIC), \
+    0, 0, 0, 0 \
+}
+/* clang-format on */
+/*
+ * Buffer pool, size buffers of buf_size bytes are allocated at init and
+ * kept in the ring until taken with sllq_pool_get(), sllq_pool_put()
+ * hands them back. exhausted counts gets that found no free buffer.
+ */
+typedef struct sllq_pool sllq_pool_t;
+struct sllq_pool {
+    sllq_t ring;
+    size_t buf_size;
+    size_t stride;
+    char*  buf;
+    size_t exhausted;
 };
 
 typedef void (*sllq_item_callback_t)(void* data);
@@ -127,17 +414,227 @@ sllq_mode_t sllq_mode(const sllq_t* queue);
 int sllq_set_mode(sllq_t* queue, sllq_mode_t mode);
 size_t sllq_size(const sllq_t* queue);
 int sllq_set_size(sllq_t* queue, size_t size);
+/*
+ * Must be called by the producer thread between pushes, the consumer may
+ * keep shifting. SLLQ_MUTEX, SLLQ_ATOMIC and SLLQ_EVENTFD modes only.
+ */
+int sllq_resize(sllq_t* queue, size_t size);
+int sllq_set_wait(sllq_t* queue, size_t spin, size_t yield);
+size_t sllq_elem_size(const sllq_t* queue);
+int sllq_set_elem_size(sllq_t* queue, size_t elem_size);
+int sllq_set_pipe_readahead(sllq_t* queue, int readahead);
+int sllq_set_pipe_coalesce(sllq_t* queue, const struct timespec* delay);
+int sllq_set_shm_name(sllq_t* queue, const char* name);
+int sllq_set_shm_fd(sllq_t* queue, int fd);
+int sllq_fd(const sllq_t* queue);
+size_t sllq_lanes(const sllq_t* queue);
+int sllq_set_lanes(sllq_t* queue, size_t lanes);
+int sllq_set_numa_node(sllq_t* queue, int node);
+int sllq_set_hugepages(sllq_t* queue, int hugepages);
+int sllq_set_prefault(sllq_t* queue, int prefault);
 
 int sllq_init(sllq_t* queue);
 int sllq_destroy(sllq_t* queue);
+int sllq_close(sllq_t* queue);
 
 int sllq_flush(sllq_t* queue, sllq_item_callback_t callback);
 
+int sllq_get_stats(sllq_t* queue, sllq_stats_t* stats);
+
+int sllq_set_latency(sllq_t* queue, int latency);
+int sllq_latency_percentile(const sllq_t* queue, double percentile, struct timespec* latency);
+int sllq_latency_reset(sllq_t* queue);
+
 int sllq_push(sllq_t* queue, void* data, const struct timespec* abstime);
 int sllq_shift(sllq_t* queue, void** data, const struct timespec* abstime);
+int sllq_push_wait(sllq_t* queue, void* data);
+int sllq_shift_wait(sllq_t* queue, void** data);
+
+int sllq_push_many(sllq_t* queue, void** items, size_t n, size_t* done, const struct timespec* abstime);
+int sllq_shift_many(sllq_t* queue, void** out, size_t max, size_t* got, const struct timespec* abstime);
+
+/* Required with sllq_set_pipe_coalesce() once pushing stops, unless closing, no timer writes out the last items */
+int sllq_push_flush(sllq_t* queue, const struct timespec* abstime);
+
+int sllq_push_msg(sllq_t* queue, const void* msg, const struct timespec* abstime);
+int sllq_shift_msg(sllq_t* queue, void* msg, const struct timespec* abstime);
+
+int sllq_steal(sllq_t* queue, void** data);
+
+int sllq_reserve(sllq_t* queue, void** slot);
+int sllq_commit(sllq_t* queue);
+int sllq_peek(sllq_t* queue, void** slot);
+int sllq_release(sllq_t* queue);
+
+int sllq_push_timed(sllq_t* queue, void* data, const struct timespec* timeout, int flags);
+int sllq_shift_timed(sllq_t* queue, void** data, const struct timespec* timeout, int flags);
+int sllq_push_prio(sllq_t* queue, void* data, size_t prio, const struct timespec* abstime);
+int sllq_push_prio_timed(sllq_t* queue, void* data, size_t prio, const struct timespec* timeout, int flags);
+int sllq_push_many_timed(sllq_t* queue, void** items, size_t n, size_t* done, const struct timespec* timeout, int flags);
+int sllq_shift_many_timed(sllq_t* queue, void** out, size_t max, size_t* got, const struct timespec* timeout, int flags);
+int sllq_push_msg_timed(sllq_t* queue, const void* msg, const struct timespec* timeout, int flags);
+int sllq_shift_msg_timed(sllq_t* queue, void* msg, const struct timespec* timeout, int flags);
+
+sllq_pool_t* sllq_pool_new(void);
+void sllq_pool_free(sllq_pool_t* pool);
+
+int sllq_pool_set_mode(sllq_pool_t* pool, sllq_mode_t mode);
+size_t sllq_pool_size(const sllq_pool_t* pool);
+int sllq_pool_set_size(sllq_pool_t* pool, size_t size);
+size_t sllq_pool_buf_size(const sllq_pool_t* pool);
+int sllq_pool_set_buf_size(sllq_pool_t* pool, size_t buf_size);
+size_t sllq_pool_exhausted(const sllq_pool_t* pool);
+
+int sllq_pool_init(sllq_pool_t* pool);
+int sllq_pool_destroy(sllq_pool_t* pool);
+
+int sllq_pool_get(sllq_pool_t* pool, void** buf, const struct timespec* abstime);
+int sllq_pool_get_timed(sllq_pool_t* pool, void** buf, const struct timespec* timeout, int flags);
+int sllq_pool_put(sllq_pool_t* pool, void* buf);
 
 const char* sllq_strerror(int errnum);
 
+/* Internal, wakes one waiter for the SLLQ_INLINE calls */
+void sllq_inline_wake_(sllq_wait_t* wait);
+
+/*
+ * Non-blocking push/shift for a mode known at compile time, spsc is
+ * SLLQ_ATOMIC and mpmc is SLLQ_MPMC. With SLLQ_INLINE defined they are
+ * inlined into the caller and the mode is not checked, queues with
+ * messages, latency or lanes, closed queues, the consumer of a resized
+ * queue and queues keeping statistics go out of line.
+ */
+#if SLLQ_INLINE
+static inline int sllq_push_spsc(sllq_t* queue, void* data)
+{
+    size_t tail;
+
+    if (!data || queue->msg || queue->stamp || queue->lane || queue->stats || __atomic_load_n(&(queue->push_wait.closed), __ATOMIC_RELAXED)) {
+        return sllq_push_timed(queue, data, 0, SLLQ_TIMEOUT_RELATIVE);
+    }
+
+    tail = queue->tail.index;
+    if (tail - queue->tail.cache >= queue->size) {
+        queue->tail.cache = __atomic_load_n(&(queue->head.index), __ATOMIC_ACQUIRE);
+        if (tail - queue->tail.cache >= queue->size) {
+            return SLLQ_FULL;
+        }
+    }
+
+    queue->ring[tail & queue->mask] = data;
+    __atomic_store_n(&(queue->tail.index), tail + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(queue->shift_wait.waiters), __ATOMIC_RELAXED)) {
+        sllq_inline_wake_(&(queue->shift_wait));
+    }
+
+    return SLLQ_OK;
+}
+
+static inline int sllq_shift_spsc(sllq_t* queue, void** data)
+{
+    size_t head;
+
+    if (!data || queue->msg || queue->stamp || queue->lane || queue->stats || queue->read_seg || __atomic_load_n(&(queue->segment), __ATOMIC_RELAXED)) {
+        return sllq_shift_timed(queue, data, 0, SLLQ_TIMEOUT_RELATIVE);
+    }
+
+    head = queue->head.index;
+    if (head == queue->head.cache) {
+        queue->head.cache = __atomic_load_n(&(queue->tail.index), __ATOMIC_ACQUIRE);
+        if (head == queue->head.cache) {
+            return __atomic_load_n(&(queue->shift_wait.closed), __ATOMIC_RELAXED) ? sllq_shift_timed(queue, data, 0, SLLQ_TIMEOUT_RELATIVE) : SLLQ_EMPTY;
+        }
+    }
+
+    *data = queue->read_ring[head & queue->read_mask];
+    __atomic_store_n(&(queue->head.index), head + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(queue->push_wait.waiters), __ATOMIC_RELAXED)) {
+        sllq_inline_wake_(&(queue->push_wait));
+    }
+
+    return SLLQ_OK;
+}
+
+static inline int sllq_push_mpmc(sllq_t* queue, void* data)
+{
+    sllq_cell_t* cell;
+    size_t       pos;
+    ssize_t      diff;
+
+    if (!data || queue->msg || queue->stamp || queue->lane || queue->stats || __atomic_load_n(&(queue->push_wait.closed), __ATOMIC_RELAXED)) {
+        return sllq_push_timed(queue, data, 0, SLLQ_TIMEOUT_RELATIVE);
+    }
+
+    pos = __atomic_load_n(&(queue->tail.index), __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &(queue->cell[pos & queue->mask]);
+        diff = (ssize_t)(__atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE) - pos);
+
+        if (!diff) {
+            if (__atomic_compare_exchange_n(&(queue->tail.index), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return SLLQ_FULL;
+        } else {
+            pos = __atomic_load_n(&(queue->tail.index), __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = data;
+    __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(queue->shift_wait.waiters), __ATOMIC_RELAXED)) {
+        sllq_inline_wake_(&(queue->shift_wait));
+    }
+
+    return SLLQ_OK;
+}
+
+static inline int sllq_shift_mpmc(sllq_t* queue, void** data)
+{
+    sllq_cell_t* cell;
+    size_t       pos;
+    ssize_t      diff;
+
+    if (!data || queue->msg || queue->stamp || queue->lane || queue->stats) {
+        return sllq_shift_timed(queue, data, 0, SLLQ_TIMEOUT_RELATIVE);
+    }
+
+    pos = __atomic_load_n(&(queue->head.index), __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &(queue->cell[pos & queue->mask]);
+        diff = (ssize_t)(__atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE) - (pos + 1));
+
+        if (!diff) {
+            if (__atomic_compare_exchange_n(&(queue->head.index), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return __atomic_load_n(&(queue->shift_wait.closed), __ATOMIC_RELAXED) ? sllq_shift_timed(queue, data, 0, SLLQ_TIMEOUT_RELATIVE) : SLLQ_EMPTY;
+        } else {
+            pos = __atomic_load_n(&(queue->head.index), __ATOMIC_RELAXED);
+        }
+    }
+
+    *data = cell->data;
+    __atomic_store_n(&(cell->seq), pos + queue->size, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(queue->push_wait.waiters), __ATOMIC_RELAXED)) {
+        sllq_inline_wake_(&(queue->push_wait));
+    }
+
+    return SLLQ_OK;
+}
+#else
+int sllq_push_spsc(sllq_t* queue, void* data);
+int sllq_shift_spsc(sllq_t* queue, void** data);
+int sllq_push_mpmc(sllq_t* queue, void* data);
+int sllq_shift_mpmc(sllq_t* queue, void** data);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
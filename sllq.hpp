@@ -0,0 +1,453 @@
+/*
+ * Author Jerry Lundström <jerry@dns-oarc.net>
+ * Copyright (c) 2017, OARC, Inc.
+ * All rights reserved.
+ *
+ * This file is part of sllq.
+ *
+ * sllq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sllq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with sllq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __sllq_hpp
+#define __sllq_hpp
+
+#include "sllq.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace sllqpp {
+
+/*
+ * Wait, the same prepare/cancel/wait/wake protocol as sllq.c but on a
+ * condition variable so it needs nothing from the platform. Wakers only
+ * take the mutex when someone is waiting.
+ */
+class wait {
+public:
+    wait()
+        : waiters_(0)
+        , seq_(0)
+    {
+    }
+
+    wait(const wait&) = delete;
+    wait& operator=(const wait&) = delete;
+
+    unsigned int prepare()
+    {
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return seq_.load(std::memory_order_acquire);
+    }
+
+    void cancel()
+    {
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    template <class Clock, class Duration>
+    bool wait_until(unsigned int seq, const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        bool woken;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            woken = cond_.wait_until(lock, deadline, [&] { return seq_.load(std::memory_order_relaxed) != seq; });
+        }
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+
+        return woken;
+    }
+
+    void wake()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed)) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                seq_.fetch_add(1, std::memory_order_release);
+            }
+            cond_.notify_one();
+        }
+    }
+
+private:
+    std::atomic<unsigned int> waiters_;
+    std::atomic<unsigned int> seq_;
+    std::mutex                mutex_;
+    std::condition_variable   cond_;
+};
+
+/*
+ * A typed queue of Capacity elements stored by value, SLLQ_ATOMIC is the
+ * single producer/single consumer ring and SLLQ_MPMC the ring of cells
+ * with sequence numbers, both as in sllq.c. The try_ calls never wait,
+ * the _for and _until calls spin and yield as set by set_wait() and then
+ * block until the deadline.
+ */
+template <typename T, std::size_t Capacity, sllq_mode_t Mode = SLLQ_ATOMIC>
+class queue {
+    static_assert(Capacity >= 2 && !(Capacity & (Capacity - 1)), "Capacity must be a power of two");
+    static_assert(Mode == SLLQ_ATOMIC || Mode == SLLQ_MPMC, "Mode must be SLLQ_ATOMIC or SLLQ_MPMC");
+    static_assert(std::is_nothrow_move_constructible<T>::value, "T must be nothrow move constructible");
+
+public:
+    static constexpr std::size_t capacity = Capacity;
+    static constexpr std::size_t mask     = Capacity - 1;
+
+    queue()
+        : spin_(0)
+        , yield_(0)
+    {
+        for (std::size_t n = 0; n < Capacity; n++) {
+            cell_[n].seq.store(n, std::memory_order_relaxed);
+        }
+        head_.index.store(0, std::memory_order_relaxed);
+        head_.cache = 0;
+        tail_.index.store(0, std::memory_order_relaxed);
+        tail_.cache = 0;
+    }
+
+    ~queue()
+    {
+        std::size_t head = head_.index.load(std::memory_order_relaxed);
+        std::size_t tail = tail_.index.load(std::memory_order_relaxed);
+
+        for (; head != tail; head++) {
+            item(head)->~T();
+        }
+    }
+
+    queue(const queue&) = delete;
+    queue& operator=(const queue&) = delete;
+
+    void set_wait(std::size_t spin, std::size_t yield)
+    {
+        spin_  = spin;
+        yield_ = yield;
+    }
+
+    /* A snapshot, exact only when called by a single producer or consumer */
+    std::size_t size() const
+    {
+        std::size_t head = head_.index.load(std::memory_order_acquire);
+        std::size_t tail = tail_.index.load(std::memory_order_acquire);
+
+        if (tail - head > Capacity) {
+            return tail < head ? 0 : Capacity;
+        }
+        return tail - head;
+    }
+
+    /*
+     * A claimed SLLQ_MPMC cell has to be published, so there a constructor
+     * that can throw runs before the claim and the result is moved in. The
+     * arguments are then used even if the queue is full.
+     */
+    template <typename... Args>
+    bool try_emplace(Args&&... args)
+    {
+        std::size_t pos;
+
+        if (Mode == SLLQ_MPMC && !std::is_nothrow_constructible<T, Args&&...>::value) {
+            T value(std::forward<Args>(args)...);
+
+            if (!claim_push(pos)) {
+                return false;
+            }
+            new (item(pos)) T(std::move(value));
+        } else {
+            if (!claim_push(pos)) {
+                return false;
+            }
+            new (item(pos)) T(std::forward<Args>(args)...);
+        }
+        publish_push(pos);
+        shift_wait_.wake();
+
+        return true;
+    }
+
+    bool try_push(const T& value)
+    {
+        return try_emplace(value);
+    }
+
+    bool try_push(T&& value)
+    {
+        return try_emplace(std::move(value));
+    }
+
+    /*
+     * Likewise a claimed SLLQ_MPMC cell is released even if the move
+     * assignment throws, the element is then dropped. SLLQ_ATOMIC has
+     * claimed nothing and keeps it.
+     */
+    bool try_pop(T& value)
+    {
+        std::size_t pos;
+
+        if (!claim_pop(pos)) {
+            return false;
+        }
+        if (Mode == SLLQ_MPMC && !std::is_nothrow_move_assignable<T>::value) {
+            popped done(*this, pos);
+
+            value = std::move(*item(pos));
+        } else {
+            value = std::move(*item(pos));
+            release_pop(pos);
+        }
+
+        return true;
+    }
+
+    /* value is only moved from if it was pushed */
+    template <typename U, class Clock, class Duration>
+    bool push_until(U&& value, const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        unsigned int seq;
+
+        for (std::size_t n = 0; !try_emplace(std::forward<U>(value)); n++) {
+            if (n < spin_ + yield_) {
+                backoff(n);
+                continue;
+            }
+            seq = push_wait_.prepare();
+            if (!full()) {
+                push_wait_.cancel();
+                continue;
+            }
+            if (!push_wait_.wait_until(seq, deadline)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    template <typename U, class Rep, class Period>
+    bool push_for(U&& value, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return push_until(std::forward<U>(value), std::chrono::steady_clock::now() + timeout);
+    }
+
+    template <class Clock, class Duration>
+    bool pop_until(T& value, const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        unsigned int seq;
+
+        for (std::size_t n = 0; !try_pop(value); n++) {
+            if (n < spin_ + yield_) {
+                backoff(n);
+                continue;
+            }
+            seq = shift_wait_.prepare();
+            if (!empty()) {
+                shift_wait_.cancel();
+                continue;
+            }
+            if (!shift_wait_.wait_until(seq, deadline)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    template <class Rep, class Period>
+    bool pop_for(T& value, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return pop_until(value, std::chrono::steady_clock::now() + timeout);
+    }
+
+private:
+    /* seq is only used in SLLQ_MPMC mode */
+    struct cell {
+        std::atomic<std::size_t> seq;
+        alignas(T) unsigned char data[sizeof(T)];
+    };
+
+    struct index {
+        std::atomic<std::size_t> index;
+        std::size_t              cache;
+
+        char pad[SLLQ_CACHELINE];
+    };
+
+    /* Releases a claimed cell when leaving try_pop(), also by an exception */
+    struct popped {
+        popped(queue& q, std::size_t pos)
+            : q_(q)
+            , pos_(pos)
+        {
+        }
+        ~popped()
+        {
+            q_.release_pop(pos_);
+        }
+
+        popped(const popped&) = delete;
+        popped& operator=(const popped&) = delete;
+
+    private:
+        queue&      q_;
+        std::size_t pos_;
+    };
+
+    T* item(std::size_t pos)
+    {
+        return reinterpret_cast<T*>(cell_[pos & mask].data);
+    }
+
+    void backoff(std::size_t n) const
+    {
+        if (n < spin_) {
+#if defined(__i386__) || defined(__x86_64__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+            __asm__ __volatile__("yield" ::: "memory");
+#else
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    bool claim_push(std::size_t& pos)
+    {
+        if (Mode == SLLQ_ATOMIC) {
+            pos = tail_.index.load(std::memory_order_relaxed);
+            if (pos - tail_.cache >= Capacity) {
+                tail_.cache = head_.index.load(std::memory_order_acquire);
+                if (pos - tail_.cache >= Capacity) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        pos = tail_.index.load(std::memory_order_relaxed);
+        for (;;) {
+            std::ptrdiff_t diff = (std::ptrdiff_t)(cell_[pos & mask].seq.load(std::memory_order_acquire) - pos);
+
+            if (!diff) {
+                if (tail_.index.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.index.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void publish_push(std::size_t pos)
+    {
+        if (Mode == SLLQ_ATOMIC) {
+            tail_.index.store(pos + 1, std::memory_order_release);
+        } else {
+            cell_[pos & mask].seq.store(pos + 1, std::memory_order_release);
+        }
+    }
+
+    bool claim_pop(std::size_t& pos)
+    {
+        if (Mode == SLLQ_ATOMIC) {
+            pos = head_.index.load(std::memory_order_relaxed);
+            if (pos == head_.cache) {
+                head_.cache = tail_.index.load(std::memory_order_acquire);
+                if (pos == head_.cache) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        pos = head_.index.load(std::memory_order_relaxed);
+        for (;;) {
+            std::ptrdiff_t diff = (std::ptrdiff_t)(cell_[pos & mask].seq.load(std::memory_order_acquire) - (pos + 1));
+
+            if (!diff) {
+                if (head_.index.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.index.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void publish_pop(std::size_t pos)
+    {
+        if (Mode == SLLQ_ATOMIC) {
+            head_.index.store(pos + 1, std::memory_order_release);
+        } else {
+            cell_[pos & mask].seq.store(pos + Capacity, std::memory_order_release);
+        }
+    }
+
+    void release_pop(std::size_t pos)
+    {
+        item(pos)->~T();
+        publish_pop(pos);
+        push_wait_.wake();
+    }
+
+    /* Checked again after preparing to wait, before going to sleep */
+    bool full() const
+    {
+        std::size_t pos = tail_.index.load(std::memory_order_relaxed);
+
+        if (Mode == SLLQ_ATOMIC) {
+            return pos - head_.index.load(std::memory_order_acquire) >= Capacity;
+        }
+        return (std::ptrdiff_t)(cell_[pos & mask].seq.load(std::memory_order_acquire) - pos) < 0;
+    }
+
+    bool empty() const
+    {
+        std::size_t pos = head_.index.load(std::memory_order_relaxed);
+
+        if (Mode == SLLQ_ATOMIC) {
+            return pos == tail_.index.load(std::memory_order_acquire);
+        }
+        return (std::ptrdiff_t)(cell_[pos & mask].seq.load(std::memory_order_acquire) - (pos + 1)) < 0;
+    }
+
+    cell        cell_[Capacity];
+    std::size_t spin_;
+    std::size_t yield_;
+    char        pad_[SLLQ_CACHELINE];
+    index       head_;
+    index       tail_;
+    wait        push_wait_;
+    wait        shift_wait_;
+};
+
+} // namespace sllqpp
+
+#endif /* __sllq_hpp */
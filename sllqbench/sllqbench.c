@@ -20,52 +20,271 @@
  */
 
 #include "config.h"
+#if HAVE_PTHREAD_ATTR_SETAFFINITY_NP && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#define SLLQ_INLINE 1
 #include "sllq.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <math.h>
+#include <inttypes.h>
 
 void usage(void)
 {
     printf(
         "usage: sllqbench [options]\n"
-        " -m mode            use mode; mutex, pipe\n"
+        " -m mode            use mode; mutex, pipe, atomic, mpmc, eventfd,\n"
+        "                    steal (shift threads steal), shm or all (-L)\n"
         " -n num             number of push/shift to do\n"
+        " -b num             push/shift in batches of num items\n"
+        " -s size            queue size (default 64)\n"
+        " -p num             push buffers from a pool of num and put them back\n"
+        "                    after shift\n"
+        " -l num             use num priority lanes and push each item to\n"
+        "                    the lane of its number modulo num (mutex, atomic,\n"
+        "                    mpmc)\n"
+        " -G size            resize the queue halfway through each run, only\n"
+        "                    the first resize changes it (mutex, atomic, eventfd)\n"
+        " -P num             number of push threads (mpmc)\n"
+        " -C num             number of shift threads (mpmc, steal)\n"
+        " -a cpu[,cpu...]    pin push then shift threads to these CPUs in turn,\n"
+        "                    ranges like 0-3 can be used\n"
+        " -w num             warmup runs that are not reported\n"
+        " -r num             number of runs to report\n"
+        " -o format          output text (default), json or csv\n"
+        " -L wait            measure round-trip latency instead of throughput,\n"
+        "                    a token bounces -n times over two queues between\n"
+        "                    two threads; wait is spin, block or both\n"
+        " -M bytes           push/shift inline messages of this size\n"
+        " -Z                 use reserve/commit and peek/release (atomic, eventfd)\n"
+        " -F                 use the inlined non-blocking calls (atomic, mpmc)\n"
+        " -N node            place the queue memory on this NUMA node\n"
+        " -U                 back the queue memory with huge pages\n"
+        " -K                 prefault and lock the queue memory at init\n"
+        " -c usec            coalesce pipe writes for up to usec (pipe)\n"
+        " -R                 do not read ahead (pipe)\n"
+        " -S                 display queue statistics (text, json)\n"
+        " -H                 display queue latency percentiles (text, json)\n"
+        " -W spin,yield      spin and yield this many times before blocking\n"
+        " -X                 shift until the queue is closed, it is closed once\n"
+        "                    the push threads are done (one run, no warmup) and\n"
+        "                    they leave coalesced pipe writes to the close\n"
         " -V                 display version and exit\n"
-        " -h                 this\n");
+        " -h                 this\n"
+        "\n"
+        "Every pushed item is numbered and checked off when shifted, the exit\n"
+        "code is 3 if a run fails or items are lost or duplicated.\n"
+        "\n"
+        "With -L the latency reported is half of each round trip, -P, -C, -b,\n"
+        "-l, -Z, -F, -N, -U, -K, -S, -H and -X do not apply.\n");
 }
 
+enum output {
+    OUTPUT_TEXT,
+    OUTPUT_JSON,
+    OUTPUT_CSV
+};
+
 struct context {
-    pthread_t thr;
-    sllq_t*   q;
-    size_t    num;
-    int       err;
+    pthread_t    thr;
+    sllq_t*      q;
+    sllq_pool_t* pool;
+    size_t       num;
+    size_t       batch;
+    size_t       next;
+    size_t       sum;
+    size_t       resize;
+    size_t       resize_at;
+    size_t       lanes;
+    void**       items;
+    void*        msg;
+    int          check;
+    int          zero_copy;
+    int          fast;
+    int          until_closed;
+    int          flush;
+    int          err;
 };
 
+struct bench {
+    sllq_t*         q;
+    size_t          producers;
+    size_t          consumers;
+    size_t          num;
+    size_t          batch;
+    size_t          msg;
+    size_t          size;
+    size_t          resize;
+    size_t          pool;
+    size_t          lanes;
+    size_t          spin;
+    size_t          yield;
+    size_t          warmup;
+    size_t          runs;
+    int             zero_copy;
+    int             fast;
+    int             close;
+    sllq_pool_t     buffers;
+    int*            cpus;
+    size_t          num_cpus;
+    struct context* ctx;
+};
+
+static const char* mode_str(sllq_mode_t mode)
+{
+    switch (mode) {
+    case SLLQ_MUTEX:
+        return "mutex";
+    case SLLQ_PIPE:
+        return "pipe";
+    case SLLQ_ATOMIC:
+        return "atomic";
+    case SLLQ_MPMC:
+        return "mpmc";
+    case SLLQ_EVENTFD:
+        return "eventfd";
+    case SLLQ_STEAL:
+        return "steal";
+    case SLLQ_SHM:
+        return "shm";
+    }
+    return "unknown";
+}
+
+static int parse_cpus(const char* str, int** cpus, size_t* num_cpus)
+{
+    char* end;
+    long  first, last;
+    int*  list;
+
+    for (;;) {
+        first = strtol(str, &end, 10);
+        if (end == str || first < 0) {
+            return -1;
+        }
+        last = first;
+        if (*end == '-') {
+            str  = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) {
+                return -1;
+            }
+        }
+        for (; first <= last; first++) {
+            if (!(list = realloc(*cpus, (*num_cpus + 1) * sizeof(int)))) {
+                return -1;
+            }
+            *cpus                   = list;
+            (*cpus)[(*num_cpus)++] = (int)first;
+        }
+        if (!*end) {
+            return 0;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        str = end + 1;
+    }
+}
+
+static inline void number(struct context* ctx, void* slot, size_t value)
+{
+    if (ctx->check) {
+        memcpy(slot, &value, sizeof(value));
+    }
+}
+
+static inline void check_off(struct context* ctx, const void* slot)
+{
+    size_t value;
+
+    if (ctx->check) {
+        memcpy(&value, slot, sizeof(value));
+        ctx->sum += value;
+    }
+}
+
 void* push(void* vp)
 {
-    struct context* ctx  = (struct context*)vp;
-    struct timespec wait = { 0, 500000 };
+    struct context* ctx   = (struct context*)vp;
+    struct timespec wait  = { 1, 0 };
+    size_t          done  = 1, n;
+    void*           slot;
+    void*           buf   = 0;
+    int             retry = ctx->zero_copy || ctx->fast || sllq_mode(ctx->q) == SLLQ_STEAL;
 
     while (ctx->num) {
-        if (sllq_mode(ctx->q) == SLLQ_MUTEX && clock_gettime(CLOCK_REALTIME, &wait)) {
-            ctx->err = -1;
-            return 0;
+        if (ctx->pool && !buf) {
+            if ((ctx->err = sllq_pool_get_timed(ctx->pool, &buf, &wait, SLLQ_TIMEOUT_RELATIVE)) == SLLQ_ETIMEDOUT)
+                continue;
+            if (ctx->err != SLLQ_OK)
+                break;
+            memcpy(buf, &(ctx->next), sizeof(ctx->next));
         }
-        wait.tv_sec++;
-        ctx->err = SLLQ_EAGAIN;
-        while (ctx->err == SLLQ_EAGAIN || ctx->err == SLLQ_FULL)
-            ctx->err = sllq_push(ctx->q, (void*)1, &wait);
+        if (ctx->resize && ctx->num <= ctx->resize_at) {
+            /* SLLQ_MUTEX can not shrink below the depth, try on the next push */
+            if ((ctx->err = sllq_resize(ctx->q, ctx->resize)) == SLLQ_OK) {
+                ctx->resize = 0;
+            } else if (ctx->err != SLLQ_FULL) {
+                break;
+            }
+        }
+        if (ctx->msg) {
+            number(ctx, ctx->msg, ctx->next);
+        } else if (ctx->batch) {
+            for (n = 0; n < ctx->batch; n++) {
+                ctx->items[n] = (void*)(ctx->next + n);
+            }
+        }
+
+        /* Only reserve/commit, the inline calls and the steal mode owner do not wait for room */
+        do {
+            if (ctx->zero_copy) {
+                if ((ctx->err = sllq_reserve(ctx->q, &slot)) == SLLQ_OK) {
+                    if (ctx->msg) {
+                        memset(slot, 1, sllq_elem_size(ctx->q));
+                        number(ctx, slot, ctx->next);
+                    } else {
+                        *(void**)slot = (void*)ctx->next;
+                    }
+                    ctx->err = sllq_commit(ctx->q);
+                }
+            } else if (ctx->fast) {
+                if (sllq_mode(ctx->q) == SLLQ_MPMC)
+                    ctx->err = sllq_push_mpmc(ctx->q, ctx->pool ? buf : (void*)ctx->next);
+                else
+                    ctx->err = sllq_push_spsc(ctx->q, ctx->pool ? buf : (void*)ctx->next);
+            } else if (ctx->msg)
+                ctx->err = sllq_push_msg_timed(ctx->q, ctx->msg, &wait, SLLQ_TIMEOUT_RELATIVE);
+            else if (ctx->batch)
+                ctx->err = sllq_push_many_timed(ctx->q, ctx->items, ctx->num < ctx->batch ? ctx->num : ctx->batch, &done, &wait, SLLQ_TIMEOUT_RELATIVE);
+            else if (ctx->lanes)
+                ctx->err = sllq_push_prio_timed(ctx->q, ctx->pool ? buf : (void*)ctx->next, ctx->next % ctx->lanes, &wait, SLLQ_TIMEOUT_RELATIVE);
+            else
+                ctx->err = sllq_push_timed(ctx->q, ctx->pool ? buf : (void*)ctx->next, &wait, SLLQ_TIMEOUT_RELATIVE);
+        } while (retry && ctx->err == SLLQ_FULL);
         if (ctx->err == SLLQ_ETIMEDOUT)
             continue;
         if (ctx->err != SLLQ_OK)
             break;
-        ctx->num--;
+        buf = 0;
+        ctx->num -= done;
+        ctx->next += done;
+    }
+
+    if (ctx->err == SLLQ_OK && ctx->flush) {
+        ctx->err = SLLQ_EAGAIN;
+        while (ctx->err == SLLQ_EAGAIN || ctx->err == SLLQ_ETIMEDOUT) {
+            ctx->err = sllq_push_flush(ctx->q, 0);
+        }
     }
 
     return 0;
@@ -73,53 +292,668 @@ void* push(void* vp)
 
 void* shift(void* vp)
 {
-    struct context* ctx  = (struct context*)vp;
-    struct timespec wait = { 0, 500000 };
+    struct context* ctx   = (struct context*)vp;
+    struct timespec wait  = { 1, 0 };
     void*           data;
+    size_t          got   = 1, n;
+    void*           slot;
+    int             retry = ctx->zero_copy || ctx->fast || sllq_mode(ctx->q) == SLLQ_STEAL;
 
     while (ctx->num) {
-        if (sllq_mode(ctx->q) == SLLQ_MUTEX && clock_gettime(CLOCK_REALTIME, &wait)) {
-            ctx->err = -1;
-            return 0;
-        }
-        wait.tv_sec++;
-        ctx->err = SLLQ_EAGAIN;
-        while (ctx->err == SLLQ_EAGAIN || ctx->err == SLLQ_EMPTY)
-            ctx->err = sllq_shift(ctx->q, &data, &wait);
+        /* Only peek/release, the inline calls and stealing do not wait for data */
+        do {
+            if (ctx->zero_copy) {
+                if ((ctx->err = sllq_peek(ctx->q, &slot)) == SLLQ_OK) {
+                    if (ctx->msg) {
+                        check_off(ctx, slot);
+                    } else {
+                        ctx->sum += (size_t)(*(void**)slot);
+                    }
+                    ctx->err = sllq_release(ctx->q);
+                }
+            } else if (ctx->fast) {
+                if (sllq_mode(ctx->q) == SLLQ_MPMC)
+                    ctx->err = sllq_shift_mpmc(ctx->q, &data);
+                else
+                    ctx->err = sllq_shift_spsc(ctx->q, &data);
+            } else if (sllq_mode(ctx->q) == SLLQ_STEAL)
+                ctx->err = sllq_steal(ctx->q, &data);
+            else if (ctx->msg)
+                ctx->err = sllq_shift_msg_timed(ctx->q, ctx->msg, &wait, SLLQ_TIMEOUT_RELATIVE);
+            else if (ctx->batch)
+                ctx->err = sllq_shift_many_timed(ctx->q, ctx->items, ctx->num < ctx->batch ? ctx->num : ctx->batch, &got, &wait, SLLQ_TIMEOUT_RELATIVE);
+            else
+                ctx->err = sllq_shift_timed(ctx->q, &data, &wait, SLLQ_TIMEOUT_RELATIVE);
+        } while (retry && (ctx->err == SLLQ_EAGAIN || ctx->err == SLLQ_EMPTY));
         if (ctx->err == SLLQ_ETIMEDOUT)
             continue;
+        if (ctx->err == SLLQ_CLOSED && ctx->until_closed) {
+            ctx->err = SLLQ_OK;
+            break;
+        }
         if (ctx->err != SLLQ_OK)
             break;
-        ctx->num--;
+        if (ctx->zero_copy) {
+            /* Checked off above before the slot was released */
+        } else if (ctx->msg) {
+            check_off(ctx, ctx->msg);
+        } else if (ctx->batch && sllq_mode(ctx->q) != SLLQ_STEAL) {
+            for (n = 0; n < got; n++) {
+                ctx->sum += (size_t)ctx->items[n];
+            }
+        } else if (ctx->pool) {
+            check_off(ctx, data);
+            if ((ctx->err = sllq_pool_put(ctx->pool, data)) != SLLQ_OK)
+                break;
+        } else {
+            ctx->sum += (size_t)data;
+        }
+        ctx->num -= got;
+    }
+
+    return 0;
+}
+
+static int start(struct bench* b, size_t n, void* (*func)(void*))
+{
+    pthread_attr_t attr;
+    int            err;
+
+    if ((err = pthread_attr_init(&attr))) {
+        errno = err;
+        perror("pthread_attr_init()");
+        return -1;
+    }
+    if (b->num_cpus) {
+#if HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(b->cpus[n % b->num_cpus], &set);
+        if ((err = pthread_attr_setaffinity_np(&attr, sizeof(set), &set))) {
+            errno = err;
+            perror("pthread_attr_setaffinity_np()");
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+#endif
     }
+    if ((err = pthread_create(&(b->ctx[n].thr), &attr, func, (void*)&(b->ctx[n])))) {
+        errno = err;
+        perror("pthread_create()");
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
 
     return 0;
 }
 
+/* Returns 0 on success, 2 if threads could not be handled, 3 if the run failed */
+static int run(struct bench* b, double* rate)
+{
+    struct timespec begin, end;
+    size_t          n, threads = b->producers + b->consumers, started, sum = 0, shifted = 0;
+    double          secs;
+    int             err, ret = 0;
+
+    for (n = 0; n < threads; n++) {
+        struct context* ctx  = &(b->ctx[n]);
+        size_t          side = n < b->producers ? b->producers : b->consumers;
+        size_t          k    = n < b->producers ? n : n - b->producers;
+
+        /* Split num over each side, the first threads take the remainder */
+        ctx->q         = b->q;
+        ctx->num       = b->num / side + (k < b->num % side ? 1 : 0);
+        ctx->next      = 1 + k * (b->num / side) + (k < b->num % side ? k : b->num % side);
+        ctx->sum       = 0;
+        ctx->resize    = n < b->producers ? b->resize : 0;
+        ctx->resize_at = ctx->num / 2;
+        ctx->lanes     = b->lanes;
+        ctx->batch     = b->batch;
+        ctx->check     = !b->msg || b->msg >= sizeof(size_t);
+        ctx->zero_copy = b->zero_copy;
+        ctx->fast      = b->fast;
+        ctx->pool      = b->pool ? &(b->buffers) : 0;
+        ctx->err       = SLLQ_OK;
+
+        /* Counted down from the top, what is left tells how many were shifted */
+        ctx->until_closed = n >= b->producers && b->close;
+        if (ctx->until_closed) {
+            ctx->num = (size_t)-1;
+        }
+        /* sllq_close() has to write out what is left */
+        ctx->flush = !b->close;
+    }
+
+    if (clock_gettime(CLOCK_MONOTONIC, &begin)) {
+        perror("clock_gettime()");
+        return 2;
+    }
+
+    for (started = 0; started < threads; started++) {
+        if (start(b, started, started < b->producers ? push : shift)) {
+            break;
+        }
+    }
+    if (started < threads) {
+        for (n = 0; n < started; n++) {
+            pthread_cancel(b->ctx[n].thr);
+        }
+        return 2;
+    }
+
+    for (n = 0; n < b->producers; n++) {
+        if ((err = pthread_join(b->ctx[n].thr, 0))) {
+            errno = err;
+            perror("pthread_join()");
+            return 2;
+        }
+        if (b->ctx[n].err != SLLQ_OK) {
+            fprintf(stderr, "push: %s\n", sllq_strerror(b->ctx[n].err));
+            ret = 3;
+        }
+    }
+    if (b->close && !ret) {
+        /* Not closed while the coalesced writes do not fit in the pipe */
+        while ((err = sllq_close(b->q)) == SLLQ_EAGAIN) {
+            sched_yield();
+        }
+        if (err) {
+            fprintf(stderr, "sllq_close(): %s\n", sllq_strerror(err));
+            ret = 3;
+        }
+    }
+    for (; n < threads; n++) {
+        if (ret) {
+            if ((err = pthread_cancel(b->ctx[n].thr))) {
+                errno = err;
+                perror("pthread_cancel()");
+                return 2;
+            }
+            continue;
+        }
+        if ((err = pthread_join(b->ctx[n].thr, 0))) {
+            errno = err;
+            perror("pthread_join()");
+            return 2;
+        }
+        if (b->ctx[n].err != SLLQ_OK || (!b->close && b->ctx[n].num)) {
+            fprintf(stderr, "shift: %s, %zu left\n", sllq_strerror(b->ctx[n].err), b->ctx[n].num);
+            ret = 3;
+        }
+        sum += b->ctx[n].sum;
+        shifted += (size_t)-1 - b->ctx[n].num;
+    }
+    if (ret) {
+        return ret;
+    }
+    if (b->close && shifted != b->num) {
+        fprintf(stderr, "shift: %zu of %zu shifted before the queue was closed\n", shifted, b->num);
+        return 3;
+    }
+
+    if (clock_gettime(CLOCK_MONOTONIC, &end)) {
+        perror("clock_gettime()");
+        return 2;
+    }
+
+    if (b->ctx[0].check && sum != b->num * (b->num + 1) / 2) {
+        fprintf(stderr, "checksum mismatch, items lost or duplicated\n");
+        return 3;
+    }
+
+    secs  = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    *rate = secs > 0 ? b->num / secs : 0;
+
+    return 0;
+}
+
+/*
+ * Round-trip latency, ping pushes the token on one queue and waits for
+ * pong to push it back on the other
+ */
+
+struct pingpong {
+    pthread_t thr;
+    sllq_t*   in;
+    sllq_t*   out;
+    size_t    num;
+    int       block;
+    void*     msg;
+    uint64_t* hops;
+    int       err;
+};
+
+static int pp_send(struct pingpong* pp)
+{
+    struct timespec wait = { 1, 0 };
+    int             err  = SLLQ_EAGAIN;
+
+    while (err == SLLQ_EAGAIN || err == SLLQ_FULL || err == SLLQ_ETIMEDOUT) {
+        if (pp->msg)
+            err = sllq_push_msg_timed(pp->out, pp->msg, pp->block ? &wait : 0, SLLQ_TIMEOUT_RELATIVE);
+        else
+            err = sllq_push_timed(pp->out, (void*)1, pp->block ? &wait : 0, SLLQ_TIMEOUT_RELATIVE);
+    }
+    if (err == SLLQ_OK) {
+        err = SLLQ_EAGAIN;
+        while (err == SLLQ_EAGAIN || err == SLLQ_ETIMEDOUT) {
+            err = sllq_push_flush(pp->out, 0);
+        }
+    }
+
+    return err;
+}
+
+static int pp_recv(struct pingpong* pp)
+{
+    struct timespec wait = { 1, 0 };
+    void*           data;
+    int             err = SLLQ_EAGAIN;
+
+    while (err == SLLQ_EAGAIN || err == SLLQ_EMPTY || err == SLLQ_ETIMEDOUT) {
+        if (sllq_mode(pp->in) == SLLQ_STEAL)
+            err = sllq_steal(pp->in, &data);
+        else if (pp->msg)
+            err = sllq_shift_msg_timed(pp->in, pp->msg, pp->block ? &wait : 0, SLLQ_TIMEOUT_RELATIVE);
+        else
+            err = sllq_shift_timed(pp->in, &data, pp->block ? &wait : 0, SLLQ_TIMEOUT_RELATIVE);
+    }
+
+    return err;
+}
+
+void* ping(void* vp)
+{
+    struct pingpong* pp = (struct pingpong*)vp;
+    struct timespec  begin, end;
+    size_t           n;
+
+    for (n = 0; n < pp->num; n++) {
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if ((pp->err = pp_send(pp)) || (pp->err = pp_recv(pp))) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        pp->hops[n] = ((end.tv_sec - begin.tv_sec) * 1000000000ULL + end.tv_nsec - begin.tv_nsec) / 2;
+    }
+
+    return 0;
+}
+
+void* pong(void* vp)
+{
+    struct pingpong* pp = (struct pingpong*)vp;
+    size_t           n;
+
+    for (n = 0; n < pp->num; n++) {
+        if ((pp->err = pp_recv(pp)) || (pp->err = pp_send(pp))) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int cmp_hop(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_rate(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int pp_queue(struct bench* b, sllq_t* q, sllq_mode_t mode)
+{
+    int err;
+
+    if ((err = sllq_set_mode(q, mode))) {
+        fprintf(stderr, "sllq_set_mode(): %s\n", sllq_strerror(err));
+        return 2;
+    }
+    if ((err = sllq_set_size(q, b->size))) {
+        fprintf(stderr, "sllq_set_size(): %s\n", sllq_strerror(err));
+        return 2;
+    }
+    if ((err = sllq_set_elem_size(q, mode == SLLQ_STEAL ? 0 : b->msg))) {
+        fprintf(stderr, "sllq_set_elem_size(): %s\n", sllq_strerror(err));
+        return 2;
+    }
+    if ((err = sllq_set_wait(q, b->spin, b->yield))) {
+        fprintf(stderr, "sllq_set_wait(): %s\n", sllq_strerror(err));
+        return 2;
+    }
+    if ((err = sllq_init(q))) {
+        fprintf(stderr, "sllq_init(): %s\n", sllq_strerror(err));
+        return 2;
+    }
+
+    return 0;
+}
+
+/* Returns 0 on success, 2 if the queues or threads could not be set up, 3 if the run failed */
+static int pp_run(struct bench* b, sllq_mode_t mode, int block, void** msg, uint64_t* hops)
+{
+    sllq_t          there = SLLQ_T_INIT, back = SLLQ_T_INIT;
+    struct pingpong pp[2];
+    size_t          run, n;
+    int             err, ret;
+    void* (*func[2])(void*) = { ping, pong };
+
+    if ((ret = pp_queue(b, &there, mode))) {
+        return ret;
+    }
+    if ((ret = pp_queue(b, &back, mode))) {
+        sllq_destroy(&there);
+        return ret;
+    }
+
+    pp[0].in  = &back;
+    pp[0].out = &there;
+    pp[1].in  = &there;
+    pp[1].out = &back;
+    for (n = 0; n < 2; n++) {
+        pp[n].num   = b->num;
+        pp[n].block = block;
+        pp[n].msg   = mode == SLLQ_STEAL ? 0 : msg[n];
+    }
+
+    for (run = 0; !ret && run < b->warmup + b->runs; run++) {
+        pp[0].hops = hops + (run < b->warmup ? 0 : (run - b->warmup) * b->num);
+
+        for (n = 0; n < 2; n++) {
+            pthread_attr_t attr;
+
+            pp[n].err = SLLQ_OK;
+            if ((err = pthread_attr_init(&attr))) {
+                errno = err;
+                perror("pthread_attr_init()");
+                ret = 2;
+                break;
+            }
+#if HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+            if (b->num_cpus) {
+                cpu_set_t set;
+
+                CPU_ZERO(&set);
+                CPU_SET(b->cpus[n % b->num_cpus], &set);
+                pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+            }
+#endif
+            err = pthread_create(&(pp[n].thr), &attr, func[n], (void*)&(pp[n]));
+            pthread_attr_destroy(&attr);
+            if (err) {
+                errno = err;
+                perror("pthread_create()");
+                if (n) {
+                    pthread_cancel(pp[0].thr);
+                }
+                ret = 2;
+                break;
+            }
+        }
+        if (ret) {
+            break;
+        }
+
+        for (n = 0; n < 2; n++) {
+            if ((err = pthread_join(pp[n].thr, 0))) {
+                errno = err;
+                perror("pthread_join()");
+                return 2;
+            }
+            if (pp[n].err != SLLQ_OK) {
+                fprintf(stderr, "%s: %s\n", n ? "pong" : "ping", sllq_strerror(pp[n].err));
+                ret = 3;
+            }
+        }
+    }
+
+    sllq_destroy(&there);
+    sllq_destroy(&back);
+
+    return ret;
+}
+
+static int round_trip(struct bench* b, enum output output, int all, sllq_mode_t mode, int wait)
+{
+    static const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+
+    uint64_t* hops;
+    void*     msg[2] = { 0, 0 };
+    size_t    total  = b->num * b->runs, n, k;
+    int       block, ret = 0;
+
+    if (!total) {
+        usage();
+        return 1;
+    }
+    if (!(hops = calloc(total, sizeof(uint64_t)))
+        || (b->msg && (!(msg[0] = calloc(1, b->msg)) || !(msg[1] = calloc(1, b->msg))))) {
+        perror("calloc()");
+        return 2;
+    }
+
+    if (output == OUTPUT_CSV) {
+        printf("mode,wait,num,msg,p50,p90,p99,p99.9,max\n");
+    }
+    for (n = all ? SLLQ_MUTEX : mode; n <= (all ? SLLQ_SHM : mode); n++) {
+        for (block = 0; block < 2; block++) {
+            const char* wait_str = block ? "block" : "spin";
+
+            /* wait is 1 for spin, 2 for block and 3 for both */
+            if (!(wait & (1 << block))) {
+                continue;
+            }
+            if ((ret = pp_run(b, (sllq_mode_t)n, block, msg, hops))) {
+                break;
+            }
+            qsort(hops, total, sizeof(uint64_t), cmp_hop);
+
+            if (output == OUTPUT_JSON) {
+                printf("{\"mode\":\"%s\",\"wait\":\"%s\",\"num\":%zu,\"msg\":%zu,\"latency_ns\":{", mode_str((sllq_mode_t)n), wait_str, total, b->msg);
+            } else if (output == OUTPUT_CSV) {
+                printf("%s,%s,%zu,%zu", mode_str((sllq_mode_t)n), wait_str, total, b->msg);
+            } else {
+                printf("%s %s:", mode_str((sllq_mode_t)n), wait_str);
+            }
+            for (k = 0; k < sizeof(percentiles) / sizeof(percentiles[0]); k++) {
+                size_t   rank = (size_t)(total * percentiles[k] / 100 + 0.999999);
+                uint64_t ns   = hops[rank ? rank - 1 : 0];
+
+                if (output == OUTPUT_JSON) {
+                    printf("%s\"p%g\":%" PRIu64, k ? "," : "", percentiles[k], ns);
+                } else if (output == OUTPUT_CSV) {
+                    printf(",%" PRIu64, ns);
+                } else {
+                    printf(" p%g: %" PRIu64 ".%03" PRIu64 "us", percentiles[k], ns / 1000, ns % 1000);
+                }
+            }
+            printf(output == OUTPUT_JSON ? "}}\n" : "\n");
+        }
+        if (ret) {
+            break;
+        }
+    }
+
+    free(hops);
+    free(msg[0]);
+    free(msg[1]);
+
+    return ret;
+}
+
 int main(int argc, char** argv)
 {
-    int             opt, err;
-    sllq_t          q    = SLLQ_T_INIT;
-    sllq_mode_t     mode = SLLQ_MUTEX;
-    struct context  a, b;
-    size_t          num = 100;
-    struct timespec start, end;
-    float           fraction;
+    static const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+
+    int             opt, err, coalesce = -1, readahead = 1, stats = 0, latency = 0, all = 0, wait = 0;
+    int             numa_node = -1, hugepages = 0, prefault = 0;
+    sllq_t          q      = SLLQ_T_INIT;
+    sllq_mode_t     mode   = SLLQ_MUTEX;
+    enum output     output = OUTPUT_TEXT;
+    struct bench    b;
+    size_t          n, threads;
+    double *        rate, *sorted;
+    double          mean = 0, stddev = 0, min = 0, max = 0, median;
+    sllq_stats_t    s;
+    struct timespec t;
 
-    while ((opt = getopt(argc, argv, "m:n:hV")) != -1) {
+    b.q         = &q;
+    b.producers = 1;
+    b.consumers = 1;
+    b.num       = 100;
+    b.batch     = 0;
+    b.msg       = 0;
+    b.zero_copy = 0;
+    b.fast      = 0;
+    b.close     = 0;
+    b.size      = 64;
+    b.resize    = 0;
+    b.pool      = 0;
+    b.lanes     = 0;
+    b.buffers   = (sllq_pool_t)SLLQ_POOL_T_INIT;
+    b.spin      = 0;
+    b.yield     = 0;
+    b.warmup    = 0;
+    b.runs      = 1;
+    b.cpus      = 0;
+    b.num_cpus  = 0;
+
+    while ((opt = getopt(argc, argv, "m:n:b:s:p:l:G:P:C:a:w:r:o:L:M:ZFN:UKc:RSHW:XhV")) != -1) {
         switch (opt) {
         case 'm':
             if (!strcmp(optarg, "mutex")) {
                 mode = SLLQ_MUTEX;
             } else if (!strcmp(optarg, "pipe")) {
                 mode = SLLQ_PIPE;
+            } else if (!strcmp(optarg, "atomic")) {
+                mode = SLLQ_ATOMIC;
+            } else if (!strcmp(optarg, "mpmc")) {
+                mode = SLLQ_MPMC;
+            } else if (!strcmp(optarg, "eventfd")) {
+                mode = SLLQ_EVENTFD;
+            } else if (!strcmp(optarg, "steal")) {
+                mode = SLLQ_STEAL;
+            } else if (!strcmp(optarg, "shm")) {
+                mode = SLLQ_SHM;
+            } else if (!strcmp(optarg, "all")) {
+                all = 1;
             } else {
                 usage();
                 return 1;
             }
             break;
         case 'n':
-            num = strtoul(optarg, 0, 10);
+            b.num = strtoul(optarg, 0, 10);
+            break;
+        case 'b':
+            b.batch = strtoul(optarg, 0, 10);
+            break;
+        case 's':
+            b.size = strtoul(optarg, 0, 10);
+            break;
+        case 'p':
+            b.pool = strtoul(optarg, 0, 10);
+            break;
+        case 'l':
+            b.lanes = strtoul(optarg, 0, 10);
+            break;
+        case 'G':
+            b.resize = strtoul(optarg, 0, 10);
+            break;
+        case 'P':
+            b.producers = strtoul(optarg, 0, 10);
+            break;
+        case 'C':
+            b.consumers = strtoul(optarg, 0, 10);
+            break;
+        case 'a':
+#if HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+            if (parse_cpus(optarg, &(b.cpus), &(b.num_cpus))) {
+                usage();
+                return 1;
+            }
+            break;
+#else
+            fprintf(stderr, "CPU pinning is not supported on this system\n");
+            return 1;
+#endif
+        case 'w':
+            b.warmup = strtoul(optarg, 0, 10);
+            break;
+        case 'r':
+            b.runs = strtoul(optarg, 0, 10);
+            break;
+        case 'o':
+            if (!strcmp(optarg, "text")) {
+                output = OUTPUT_TEXT;
+            } else if (!strcmp(optarg, "json")) {
+                output = OUTPUT_JSON;
+            } else if (!strcmp(optarg, "csv")) {
+                output = OUTPUT_CSV;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'L':
+            if (!strcmp(optarg, "spin")) {
+                wait = 1;
+            } else if (!strcmp(optarg, "block")) {
+                wait = 2;
+            } else if (!strcmp(optarg, "both")) {
+                wait = 3;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'M':
+            b.msg = strtoul(optarg, 0, 10);
+            break;
+        case 'Z':
+            b.zero_copy = 1;
+            break;
+        case 'F':
+            b.fast = 1;
+            break;
+        case 'N':
+            numa_node = atoi(optarg);
+            break;
+        case 'U':
+            hugepages = 1;
+            break;
+        case 'K':
+            prefault = 1;
+            break;
+        case 'c':
+            coalesce = atoi(optarg);
+            break;
+        case 'R':
+            readahead = 0;
+            break;
+        case 'S':
+            stats = 1;
+            break;
+        case 'H':
+            latency = 1;
+            break;
+        case 'W':
+            if (sscanf(optarg, "%zu,%zu", &(b.spin), &(b.yield)) != 2) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'X':
+            b.close = 1;
             break;
         case 'h':
             usage();
@@ -133,76 +967,205 @@ int main(int argc, char** argv)
         }
     }
 
+    if (!b.producers || !b.consumers || !b.runs || (all && !wait) || (b.pool && (b.batch || b.msg || b.zero_copy))
+        || (b.close && (b.runs > 1 || b.warmup))
+        || (b.lanes && (b.batch || b.msg || b.zero_copy || b.resize))
+        || (b.fast && (b.batch || b.msg || b.zero_copy || b.lanes || (mode != SLLQ_ATOMIC && mode != SLLQ_MPMC)))) {
+        usage();
+        return 1;
+    }
+    if (wait) {
+        return round_trip(&b, output, all, mode, wait);
+    }
+    if (b.producers > 1 && mode != SLLQ_MPMC) {
+        fprintf(stderr, "mode %s only supports one push thread\n", mode_str(mode));
+        return 1;
+    }
+    if (b.consumers > 1 && mode != SLLQ_MPMC && mode != SLLQ_STEAL) {
+        fprintf(stderr, "mode %s only supports one shift thread\n", mode_str(mode));
+        return 1;
+    }
+    threads = b.producers + b.consumers;
+
     if ((err = sllq_set_mode(&q, mode))) {
         fprintf(stderr, "sllq_set_mode(): %s\n", sllq_strerror(err));
         return 2;
     }
-    if ((err = sllq_set_size(&q, 64))) {
+    if ((err = sllq_set_size(&q, b.size))) {
         fprintf(stderr, "sllq_set_size(): %s\n", sllq_strerror(err));
         return 2;
     }
-    if ((err = sllq_init(&q))) {
-        fprintf(stderr, "sllq_set_size(): %s\n", sllq_strerror(err));
+    if ((err = sllq_set_elem_size(&q, b.msg))) {
+        fprintf(stderr, "sllq_set_elem_size(): %s\n", sllq_strerror(err));
         return 2;
     }
-    a.q   = &q;
-    a.num = num;
-    b.q   = &q;
-    b.num = num;
-
-    if (clock_gettime(CLOCK_MONOTONIC, &start)) {
-        perror("clock_gettime()");
+    if ((err = sllq_set_pipe_readahead(&q, readahead))) {
+        fprintf(stderr, "sllq_set_pipe_readahead(): %s\n", sllq_strerror(err));
         return 2;
     }
+    if (coalesce > -1) {
+        struct timespec delay = { coalesce / 1000000, (coalesce % 1000000) * 1000 };
 
-    if ((err = pthread_create(&(a.thr), 0, push, (void*)&a))) {
-        errno = err;
-        perror("pthread_create()");
+        if ((err = sllq_set_pipe_coalesce(&q, &delay))) {
+            fprintf(stderr, "sllq_set_pipe_coalesce(): %s\n", sllq_strerror(err));
+            return 2;
+        }
+    }
+    if (b.lanes && (err = sllq_set_lanes(&q, b.lanes))) {
+        fprintf(stderr, "sllq_set_lanes(): %s\n", sllq_strerror(err));
         return 2;
     }
-    if ((err = pthread_create(&(b.thr), 0, shift, (void*)&b))) {
-        errno = err;
-        perror("pthread_create()");
-        pthread_cancel(a.thr);
+    if ((err = sllq_set_latency(&q, latency))) {
+        fprintf(stderr, "sllq_set_latency(): %s\n", sllq_strerror(err));
         return 2;
     }
-    if ((err = pthread_join(a.thr, 0))) {
-        errno = err;
-        perror("pthread_join()");
-        pthread_cancel(b.thr);
+    if ((err = sllq_set_numa_node(&q, numa_node))) {
+        fprintf(stderr, "sllq_set_numa_node(): %s\n", sllq_strerror(err));
         return 2;
     }
-    if (a.err == SLLQ_OK) {
-        if ((err = pthread_join(b.thr, 0))) {
-            errno = err;
-            perror("pthread_join()");
+    if ((err = sllq_set_hugepages(&q, hugepages))) {
+        fprintf(stderr, "sllq_set_hugepages(): %s\n", sllq_strerror(err));
+        return 2;
+    }
+    if ((err = sllq_set_prefault(&q, prefault))) {
+        fprintf(stderr, "sllq_set_prefault(): %s\n", sllq_strerror(err));
+        return 2;
+    }
+    if ((err = sllq_set_wait(&q, b.spin, b.yield))) {
+        fprintf(stderr, "sllq_set_wait(): %s\n", sllq_strerror(err));
+        return 2;
+    }
+    if ((err = sllq_init(&q))) {
+        fprintf(stderr, "sllq_init(): %s\n", sllq_strerror(err));
+        return 2;
+    }
+    if (b.pool) {
+        if ((err = sllq_pool_set_mode(&(b.buffers), threads > 2 ? SLLQ_MPMC : SLLQ_ATOMIC))
+            || (err = sllq_pool_set_size(&(b.buffers), b.pool))
+            || (err = sllq_pool_set_buf_size(&(b.buffers), sizeof(size_t)))
+            || (err = sllq_pool_init(&(b.buffers)))) {
+            fprintf(stderr, "sllq_pool_init(): %s\n", sllq_strerror(err));
             return 2;
         }
-    } else {
-        if ((err = pthread_cancel(b.thr))) {
-            errno = err;
-            perror("pthread_cancel()");
+    }
+
+    if (!(b.ctx = calloc(threads, sizeof(struct context))) || !(rate = calloc(b.runs, sizeof(double)))
+        || !(sorted = calloc(b.runs, sizeof(double)))) {
+        perror("calloc()");
+        return 2;
+    }
+    for (n = 0; n < threads; n++) {
+        if (b.msg && !(b.ctx[n].msg = calloc(1, b.msg))) {
+            perror("calloc()");
+            return 2;
+        }
+        if (b.batch && !(b.ctx[n].items = calloc(b.batch, sizeof(void*)))) {
+            perror("calloc()");
             return 2;
         }
     }
 
-    if (clock_gettime(CLOCK_MONOTONIC, &end)) {
-        perror("clock_gettime()");
+    for (n = 0; n < b.warmup; n++) {
+        if ((err = run(&b, &(rate[0])))) {
+            return err;
+        }
+    }
+    if (b.warmup && latency && (err = sllq_latency_reset(&q))) {
+        fprintf(stderr, "sllq_latency_reset(): %s\n", sllq_strerror(err));
         return 2;
     }
+    for (n = 0; n < b.runs; n++) {
+        if ((err = run(&b, &(rate[n])))) {
+            return err;
+        }
+        if (!n || rate[n] < min) {
+            min = rate[n];
+        }
+        if (!n || rate[n] > max) {
+            max = rate[n];
+        }
+        mean += rate[n];
+    }
+    mean /= b.runs;
+    if (b.runs > 1) {
+        for (n = 0; n < b.runs; n++) {
+            stddev += (rate[n] - mean) * (rate[n] - mean);
+        }
+        stddev = sqrt(stddev / (b.runs - 1));
+    }
+    memcpy(sorted, rate, b.runs * sizeof(double));
+    qsort(sorted, b.runs, sizeof(double), cmp_rate);
+    median = b.runs & 1 ? sorted[b.runs / 2] : (sorted[b.runs / 2 - 1] + sorted[b.runs / 2]) / 2;
 
-    printf("push: %d %lu\n", a.err, num - a.num);
-    printf("shift: %d %lu\n", b.err, num - b.num);
-
-    if (end.tv_sec == start.tv_sec && end.tv_nsec >= start.tv_nsec) {
-        fraction = 1. / (((float)end.tv_nsec - (float)start.tv_nsec) / (float)1000000000);
-    } else if (end.tv_sec > start.tv_sec) {
-        fraction = 1. / (((float)end.tv_sec - (float)start.tv_sec - 1) + ((float)(1000000000 - start.tv_nsec + end.tv_nsec) / (float)1000000000));
-    } else {
-        fraction = 0.;
+    if (stats && (err = sllq_get_stats(&q, &s))) {
+        fprintf(stderr, "sllq_get_stats(): %s\n", sllq_strerror(err));
+        return 2;
     }
-    if (!b.num && fraction) {
-        printf("%.0f/sec\n", num * fraction);
+
+    switch (output) {
+    case OUTPUT_TEXT:
+        for (n = 0; n < b.runs; n++) {
+            printf("%.0f/sec\n", rate[n]);
+        }
+        if (b.runs > 1) {
+            printf("mean: %.0f/sec stddev: %.0f min: %.0f max: %.0f median: %.0f\n", mean, stddev, min, max, median);
+        }
+        if (stats) {
+            printf("pushes: %zu again: %zu full: %zu waits: %zu timeouts: %zu wakeups: %zu\n",
+                s.pushes, s.push_again, s.push_full, s.push_waits, s.push_timeouts, s.push_wakeups);
+            printf("shifts: %zu again: %zu empty: %zu waits: %zu timeouts: %zu wakeups: %zu\n",
+                s.shifts, s.shift_again, s.shift_empty, s.shift_waits, s.shift_timeouts, s.shift_wakeups);
+            printf("depth: %zu high-water: %zu\n", s.depth, s.high_water);
+            if (b.pool) {
+                printf("pool exhausted: %zu\n", sllq_pool_exhausted(&(b.buffers)));
+            }
+        }
+        if (latency) {
+            printf("latency:");
+            for (n = 0; n < sizeof(percentiles) / sizeof(percentiles[0]); n++) {
+                if ((err = sllq_latency_percentile(&q, percentiles[n], &t))) {
+                    fprintf(stderr, "sllq_latency_percentile(): %s\n", sllq_strerror(err));
+                    return 2;
+                }
+                printf(" p%g: %ld.%03ldus", percentiles[n], (long)t.tv_sec * 1000000 + t.tv_nsec / 1000, t.tv_nsec % 1000);
+            }
+            printf("\n");
+        }
+        break;
+
+    case OUTPUT_JSON:
+        printf("{\"mode\":\"%s\",\"producers\":%zu,\"consumers\":%zu,\"size\":%zu,\"num\":%zu,\"batch\":%zu,\"msg\":%zu,\"runs\":[",
+            mode_str(mode), b.producers, b.consumers, b.size, b.num, b.batch, b.msg);
+        for (n = 0; n < b.runs; n++) {
+            printf("%s%.0f", n ? "," : "", rate[n]);
+        }
+        printf("],\"mean\":%.0f,\"stddev\":%.0f,\"min\":%.0f,\"max\":%.0f,\"median\":%.0f", mean, stddev, min, max, median);
+        if (stats) {
+            printf(",\"stats\":{\"pushes\":%zu,\"push_again\":%zu,\"push_full\":%zu,\"push_waits\":%zu,\"push_timeouts\":%zu,\"push_wakeups\":%zu",
+                s.pushes, s.push_again, s.push_full, s.push_waits, s.push_timeouts, s.push_wakeups);
+            printf(",\"shifts\":%zu,\"shift_again\":%zu,\"shift_empty\":%zu,\"shift_waits\":%zu,\"shift_timeouts\":%zu,\"shift_wakeups\":%zu",
+                s.shifts, s.shift_again, s.shift_empty, s.shift_waits, s.shift_timeouts, s.shift_wakeups);
+            printf(",\"depth\":%zu,\"high_water\":%zu}", s.depth, s.high_water);
+        }
+        if (latency) {
+            printf(",\"latency_ns\":{");
+            for (n = 0; n < sizeof(percentiles) / sizeof(percentiles[0]); n++) {
+                if ((err = sllq_latency_percentile(&q, percentiles[n], &t))) {
+                    fprintf(stderr, "sllq_latency_percentile(): %s\n", sllq_strerror(err));
+                    return 2;
+                }
+                printf("%s\"p%g\":%ld", n ? "," : "", percentiles[n], (long)t.tv_sec * 1000000000 + t.tv_nsec);
+            }
+            printf("}");
+        }
+        printf("}\n");
+        break;
+
+    case OUTPUT_CSV:
+        printf("mode,producers,consumers,size,num,batch,msg,runs,mean,stddev,min,max,median\n");
+        printf("%s,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%.0f,%.0f,%.0f,%.0f,%.0f\n",
+            mode_str(mode), b.producers, b.consumers, b.size, b.num, b.batch, b.msg, b.runs, mean, stddev, min, max, median);
+        break;
     }
 
     return 0;
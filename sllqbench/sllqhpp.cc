@@ -0,0 +1,245 @@
+/*
+ * Author Jerry Lundström <jerry@dns-oarc.net>
+ * Copyright (c) 2017, OARC, Inc.
+ * All rights reserved.
+ *
+ * This file is part of sllq.
+ *
+ * sllq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sllq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with sllq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Builds sllq.hpp, and the SLLQ_INLINE calls of sllq.h as C++, and runs
+ * each queue mode through single and threaded push/pop, timeouts and a
+ * throwing copy and move assignment, then the SLLQ_INLINE calls through
+ * a C queue of each mode, exits 1 on the first failure
+ */
+
+#define SLLQ_INLINE 1
+#include "sllq.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define check(x)                                                         \
+    do {                                                                 \
+        if (!(x)) {                                                      \
+            std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #x); \
+            return 1;                                                    \
+        }                                                                \
+    } while (0)
+
+/* Copies and move assignments throw when told to, move construction never does */
+struct fragile {
+    static bool fail;
+    static bool fail_assign;
+
+    std::string value;
+
+    fragile(const char* v)
+        : value(v)
+    {
+    }
+    fragile(const fragile& other)
+        : value(other.value)
+    {
+        if (fail) {
+            throw std::runtime_error("copy");
+        }
+    }
+    fragile(fragile&& other) noexcept
+        : value(std::move(other.value))
+    {
+    }
+    fragile& operator=(fragile&& other)
+    {
+        if (fail_assign) {
+            throw std::runtime_error("assign");
+        }
+        value = std::move(other.value);
+        return *this;
+    }
+};
+
+bool fragile::fail        = false;
+bool fragile::fail_assign = false;
+
+template <sllq_mode_t Mode>
+static int single()
+{
+    sllqpp::queue<std::string, 4, Mode> q;
+    std::string                         s;
+    std::string                         keep("keep");
+
+    for (int n = 0; n < 4; n++) {
+        check(q.try_push(std::to_string(n)));
+    }
+    check(!q.try_push(std::string("full")));
+    check(q.size() == 4);
+    check(!q.push_for(std::move(keep), std::chrono::milliseconds(10)));
+    check(keep == "keep");
+    for (int n = 0; n < 4; n++) {
+        check(q.try_pop(s) && s == std::to_string(n));
+    }
+    check(!q.try_pop(s));
+    check(!q.pop_for(s, std::chrono::milliseconds(10)));
+    check(q.try_emplace(3, 'x') && q.try_pop(s) && s == "xxx");
+
+    return 0;
+}
+
+template <sllq_mode_t Mode>
+static int throwing()
+{
+    sllqpp::queue<fragile, 2, Mode> q;
+    fragile                         f("a");
+
+    fragile::fail = true;
+    try {
+        q.try_push(f);
+        check(0);
+    } catch (const std::runtime_error&) {
+    }
+    fragile::fail = false;
+
+    /* Nothing was left half pushed */
+    check(q.size() == 0);
+    check(q.try_push(f) && q.try_push(fragile("b")));
+    check(q.try_pop(f) && f.value == "a");
+    check(q.try_pop(f) && f.value == "b");
+    check(!q.try_pop(f));
+
+    check(q.try_push(fragile("c")));
+    fragile::fail_assign = true;
+    try {
+        q.try_pop(f);
+        check(0);
+    } catch (const std::runtime_error&) {
+    }
+    fragile::fail_assign = false;
+
+    /* SLLQ_MPMC dropped the item but no cell was left claimed */
+    if (Mode == SLLQ_ATOMIC) {
+        check(q.try_pop(f) && f.value == "c");
+    }
+    check(q.size() == 0);
+    check(q.try_push(fragile("d")) && q.try_push(fragile("e")));
+    check(q.try_pop(f) && f.value == "d");
+    check(q.try_pop(f) && f.value == "e");
+    check(!q.try_pop(f));
+
+    return 0;
+}
+
+template <sllq_mode_t Mode>
+static int threaded(std::size_t producers, std::size_t consumers)
+{
+    const std::size_t                    num = 100000;
+    sllqpp::queue<std::size_t, 64, Mode> q;
+    std::vector<std::thread>             threads;
+    std::vector<std::size_t>             sums(consumers);
+    std::size_t                          sum = 0;
+
+    q.set_wait(16, 16);
+    for (std::size_t p = 0; p < producers; p++) {
+        threads.emplace_back([&q, p, producers, num] {
+            for (std::size_t n = p + 1; n <= num; n += producers) {
+                q.push_for(n, std::chrono::seconds(10));
+            }
+        });
+    }
+    for (std::size_t c = 0; c < consumers; c++) {
+        threads.emplace_back([&q, &sums, c, consumers, num] {
+            std::size_t v;
+
+            for (std::size_t n = c; n < num; n += consumers) {
+                if (!q.pop_for(v, std::chrono::seconds(10))) {
+                    return;
+                }
+                sums[c] += v;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (auto s : sums) {
+        sum += s;
+    }
+    check(sum == num * (num + 1) / 2);
+
+    return 0;
+}
+
+static int inline_push(sllq_t* q, void* data)
+{
+    return sllq_mode(q) == SLLQ_ATOMIC ? sllq_push_spsc(q, data) : sllq_push_mpmc(q, data);
+}
+
+static int inline_shift(sllq_t* q, void** data)
+{
+    return sllq_mode(q) == SLLQ_ATOMIC ? sllq_shift_spsc(q, data) : sllq_shift_mpmc(q, data);
+}
+
+static int inlined(sllq_mode_t mode)
+{
+    sllq_t      q = SLLQ_T_INIT;
+    void*       data;
+    std::size_t n;
+    int         err;
+
+    check(!sllq_set_mode(&q, mode) && !sllq_set_size(&q, 4) && !sllq_init(&q));
+    for (n = 1; n <= 4; n++) {
+        check(inline_push(&q, (void*)n) == SLLQ_OK);
+    }
+    check(inline_push(&q, (void*)n) == SLLQ_FULL);
+    for (n = 1; n <= 4; n++) {
+        check(inline_shift(&q, &data) == SLLQ_OK && data == (void*)n);
+    }
+    check(inline_shift(&q, &data) == SLLQ_EMPTY);
+
+    /* A consumer blocked out of line is woken by an inline push */
+    std::thread consumer([&q, &data] {
+        struct timespec timeout = { 10, 0 };
+
+        sllq_shift_timed(&q, &data, &timeout, SLLQ_TIMEOUT_RELATIVE);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    err = inline_push(&q, (void*)&q);
+    consumer.join();
+    check(err == SLLQ_OK && data == (void*)&q);
+
+    check(!sllq_close(&q));
+    check(inline_push(&q, (void*)&q) == SLLQ_CLOSED);
+    check(inline_shift(&q, &data) == SLLQ_CLOSED);
+    check(!sllq_destroy(&q));
+
+    return 0;
+}
+
+int main()
+{
+    if (single<SLLQ_ATOMIC>() || single<SLLQ_MPMC>()
+        || throwing<SLLQ_ATOMIC>() || throwing<SLLQ_MPMC>()
+        || threaded<SLLQ_ATOMIC>(1, 1) || threaded<SLLQ_MPMC>(2, 2)
+        || inlined(SLLQ_ATOMIC) || inlined(SLLQ_MPMC)) {
+        return 1;
+    }
+
+    return 0;
+}
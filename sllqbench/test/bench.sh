@@ -0,0 +1,97 @@
+# Author Jerry Lundström <jerry@dns-oarc.net>
+# Copyright (c) 2017, OARC, Inc.
+# All rights reserved.
+#
+# This file is part of sllq.
+#
+# sllq is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sllq is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with sllq.  If not, see <http://www.gnu.org/licenses/>.
+
+# Runs a fixed matrix of mode, queue size, threads and batch size through
+# sllqbench and compares each against the baseline. An entry regresses
+# when the median of its runs is more than the tolerance below the median
+# recorded in the baseline, one slow or fast run does not move it.
+#
+# SLLQ_BENCH_BASELINE   the baseline, default bench.baseline in srcdir
+# SLLQ_BENCH_TOLERANCE  percent the median may drop, default 20
+# SLLQ_BENCH_NUM        items per run, default 100000
+# SLLQ_BENCH_RUNS       runs per entry, default 5
+# SLLQ_BENCH_RESULTS    where to write the results, default bench.results
+#
+# The rates depend on the machine so the baseline must be recorded on the
+# machine it is compared on, the results use the same format and are
+# copied to the baseline to record one. Without a baseline nothing is
+# compared and a warning is printed.
+
+srcdir="${srcdir:-.}"
+baseline="${SLLQ_BENCH_BASELINE:-$srcdir/bench.baseline}"
+results="${SLLQ_BENCH_RESULTS:-bench.results}"
+tolerance="${SLLQ_BENCH_TOLERANCE:-20}"
+num="${SLLQ_BENCH_NUM:-100000}"
+runs="${SLLQ_BENCH_RUNS:-5}"
+
+echo "# mode,producers,consumers,size,num,batch,msg,runs,mean,stddev,min,max,median" > "$results"
+
+run() {
+    out=`../sllqbench -o csv -w 1 -r "$runs" -n "$num" "$@"` || exit 1
+    echo "$out" | tail -n 1 >> "$results"
+}
+
+for size in 64 1024; do
+    for batch in 0 16; do
+        for mode in mutex pipe atomic mpmc eventfd shm; do
+            run -m "$mode" -s "$size" -b "$batch"
+        done
+        run -m mpmc -P 2 -C 2 -s "$size" -b "$batch"
+        # Thieves spin, keep it short on machines with few cores
+        run -m steal -C 2 -s "$size" -b "$batch" -n "$((num / 10))"
+    done
+done
+
+if [ ! -f "$baseline" ]; then
+    cat "$results"
+    echo "WARNING: no baseline $baseline, nothing was compared" >&2
+    echo "WARNING: record one on this machine with: cp $results $baseline" >&2
+    exit 0
+fi
+
+# Match on mode, producers, consumers, size, batch and msg, a missing
+# baseline entry, or one without a median, is reported but does not fail
+awk -F, -v tolerance="$tolerance" '
+    /^#/ { next }
+    NR == FNR {
+        if (NF >= 13) {
+            base[$1 "," $2 "," $3 "," $4 "," $6 "," $7] = $13
+        }
+        next
+    }
+    {
+        key = $1 "," $2 "," $3 "," $4 "," $6 "," $7
+        if (!(key in base)) {
+            printf("%-32s %12.0f/sec  no baseline\n", key, $13)
+            next
+        }
+        change = (base[key] > 0) ? ($13 - base[key]) * 100 / base[key] : 0
+        status = (change < -tolerance) ? "REGRESSION" : "ok"
+        if (status != "ok") {
+            failed++
+        }
+        printf("%-32s %12.0f/sec %12.0f/sec %+7.1f%%  %s\n", key, $13, base[key], change, status)
+    }
+    END {
+        if (failed) {
+            printf("%d regression(s) beyond %s%%\n", failed, tolerance)
+            exit 1
+        }
+    }
+' "$baseline" "$results"
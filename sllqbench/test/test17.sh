@@ -0,0 +1,26 @@
+# Author Jerry Lundström <jerry@dns-oarc.net>
+# Copyright (c) 2017, OARC, Inc.
+# All rights reserved.
+#
+# This file is part of sllq.
+#
+# sllq is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sllq is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with sllq.  If not, see <http://www.gnu.org/licenses/>.
+
+../sllqbench -n 10000 -m mutex -s 4 -G 1024 \
+    && ../sllqbench -n 10000 -m mutex -s 1024 -G 2 -r 2 \
+    && ../sllqbench -n 10000 -m atomic -s 4 -G 1024 \
+    && ../sllqbench -n 10000 -m atomic -s 1024 -G 2 -b 8 \
+    && ../sllqbench -n 10000 -m eventfd -s 2 -G 64 -r 2 \
+    && ../sllqbench -n 10000 -m eventfd -s 64 -G 4 -Z \
+    && ! ../sllqbench -n 1000 -m mpmc -G 128
@@ -0,0 +1,26 @@
+# Author Jerry Lundström <jerry@dns-oarc.net>
+# Copyright (c) 2017, OARC, Inc.
+# All rights reserved.
+#
+# This file is part of sllq.
+#
+# sllq is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sllq is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with sllq.  If not, see <http://www.gnu.org/licenses/>.
+
+../sllqbench -n 10000 -m atomic -p 128 -S \
+    && ../sllqbench -n 10000 -m mutex -p 16 \
+    && ../sllqbench -n 10000 -m pipe -p 64 \
+    && ../sllqbench -n 10000 -m mpmc -P 2 -C 2 -p 256 \
+    && ../sllqbench -n 10000 -m eventfd -s 16 -p 4 -S \
+    && ../sllqbench -n 1000 -m steal -C 2 -p 128 \
+    && ! ../sllqbench -n 1000 -m atomic -p 100
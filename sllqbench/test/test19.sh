@@ -0,0 +1,25 @@
+# Author Jerry Lundström <jerry@dns-oarc.net>
+# Copyright (c) 2017, OARC, Inc.
+# All rights reserved.
+#
+# This file is part of sllq.
+#
+# sllq is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sllq is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with sllq.  If not, see <http://www.gnu.org/licenses/>.
+
+../sllqbench -n 10000 -m atomic -l 3 -S \
+    && ../sllqbench -n 10000 -m mutex -l 2 \
+    && ../sllqbench -n 10000 -m mpmc -P 2 -C 2 -l 4 \
+    && ../sllqbench -n 10000 -m atomic -s 16 -l 8 -p 64 -S \
+    && ! ../sllqbench -n 1000 -m pipe -l 2 \
+    && ! ../sllqbench -n 1000 -m atomic -l 2 -H
@@ -0,0 +1,24 @@
+# Author Jerry Lundström <jerry@dns-oarc.net>
+# Copyright (c) 2017, OARC, Inc.
+# All rights reserved.
+#
+# This file is part of sllq.
+#
+# sllq is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sllq is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with sllq.  If not, see <http://www.gnu.org/licenses/>.
+
+../sllqbench -n 2000 -m atomic -F -S \
+    && ../sllqbench -n 2000 -m mpmc -F \
+    && ../sllqbench -n 2000 -m mpmc -P 2 -C 2 -F \
+    && ../sllqbench -n 2000 -m atomic -s 16 -p 32 -F \
+    && ! ../sllqbench -n 1000 -m mutex -F
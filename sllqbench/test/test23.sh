@@ -0,0 +1,28 @@
+# Author Jerry Lundström <jerry@dns-oarc.net>
+# Copyright (c) 2017, OARC, Inc.
+# All rights reserved.
+#
+# This file is part of sllq.
+#
+# sllq is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sllq is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with sllq.  If not, see <http://www.gnu.org/licenses/>.
+
+../sllqbench -n 2000 -m mutex -X \
+    && ../sllqbench -n 2000 -m pipe -c 100 -X \
+    && ../sllqbench -n 2000 -m atomic -b 8 -X \
+    && ../sllqbench -n 2000 -m mpmc -P 2 -C 3 -X \
+    && ../sllqbench -n 2000 -m eventfd -Z -X \
+    && ../sllqbench -n 2000 -m steal -C 2 -X \
+    && ../sllqbench -n 2000 -m shm -M 32 -X \
+    && ../sllqbench -n 2000 -m mpmc -l 3 -C 2 -X \
+    && ! ../sllqbench -n 1000 -m atomic -X -r 2